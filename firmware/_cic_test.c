@@ -0,0 +1,101 @@
+// Host test of the CIC decimator (see cic.c), fed synthetic conversions. Build and
+// run it on a PC with `make cic_test`.
+
+#include "stdio.h"
+#include "math.h"
+
+#include "cic.c"
+
+#define TEST_SAMPLES 2000 // Decimated outputs of each test.
+#define TEST_SETTLE (CIC_ORDER + 1) // Outputs the stages take to fill.
+#define ADC_MAX 4095 // Largest 12-bit conversion.
+
+uint16_t failures = 0;
+
+// Report a check, counting those that fail.
+void check(uint8_t ok, char *what, int got, int expected)
+{
+	if (!ok) {
+		failures++;
+	}
+	printf("%s %s: got %d, expected %d\n", ok ? "ok  " : "FAIL", what, got, expected);
+}
+
+// Output for a constant input once the stages have filled: the gain of the stages,
+// CIC_DECIMATION^CIC_ORDER, undone by CIC_SCALE.
+int cic_dc(int x)
+{
+	int gain = 1, i;
+	for (i = 0; i < CIC_ORDER; i++) {
+		gain *= CIC_DECIMATION;
+	}
+	return ((uint32_t)x * gain * CIC_SCALE) >> 16;
+}
+
+// A step from silence to a level settles on the scaled level, and stays there long
+// after the integrators have wrapped around.
+void test_step(uint16_t level)
+{
+	struct cic cic;
+	uint16_t i, j, out = 0, steady = 1;
+	char what[32];
+
+	cic_reset(&cic);
+	for (i = 0; i < TEST_SAMPLES; i++) {
+		for (j = 0; j < CIC_DECIMATION; j++) {
+			cic_push(&cic, i < TEST_SAMPLES / 4 ? 0 : level);
+		}
+		out = cic_pull(&cic);
+		if (i >= TEST_SAMPLES / 4 + TEST_SETTLE && out != cic_dc(level)) {
+			steady = 0;
+		}
+	}
+	sprintf(what, "step to %d", level);
+	check(steady && out == cic_dc(level), what, out, cic_dc(level));
+}
+
+// A full-scale sine well inside the passband comes out with its full swing, and
+// the output never leaves the range of the inputs.
+void test_sine()
+{
+	struct cic cic;
+	uint16_t i, j, out, min = ADC_MAX, max = 0;
+	uint32_t n = 0;
+	double period = 40.0 * CIC_DECIMATION; // conversions per cycle, 40 outputs
+
+	cic_reset(&cic);
+	for (i = 0; i < TEST_SAMPLES; i++) {
+		for (j = 0; j < CIC_DECIMATION; j++, n++) {
+			cic_push(&cic, (uint16_t)(2047.5 + 2047.5 * sin(2 * M_PI * n / period)));
+		}
+		out = cic_pull(&cic);
+		if (i < TEST_SETTLE) {
+			continue;
+		}
+		if (out < min) {
+			min = out;
+		}
+		if (out > max) {
+			max = out;
+		}
+	}
+	// the moving sums droop by a few percent at this frequency
+	check(max <= cic_dc(ADC_MAX), "sine peak in range", max, cic_dc(ADC_MAX));
+	check(max - min > cic_dc(ADC_MAX) * 95 / 100, "sine swing", max - min, cic_dc(ADC_MAX) * 95 / 100);
+	check(max + min > ADC_MAX - 40 && max + min < ADC_MAX + 40, "sine centred", (max + min) / 2, ADC_MAX / 2);
+}
+
+int main()
+{
+	test_step(100);
+	test_step(2048);
+	test_step(ADC_MAX);
+	test_sine();
+
+	if (failures) {
+		printf("%d failed\n", failures);
+		return 1;
+	}
+	printf("all passed\n");
+	return 0;
+}
@@ -22,6 +22,13 @@
 // Modified 2014-03-11 by Michael Mokrysz
 //  - Set 2 ADC channels for guitar input and added microphone input channel
 
+// The ADC converts channels 0 to 2 in burst mode. Rather than reading the latest
+// results from the audio interrupt, the GPDMA copies the global data register into
+// adc_ring ADC_OVERSAMPLE times in every sample period, and adc_sample() runs the
+// oldest group of conversions not used yet through a CIC decimator for each
+// channel (see cic.c), lowering the noise floor. A block of samples (see timer.c)
+// is made from the groups which arrived while the previous block was played.
+
 #ifndef _HAPR_ADC
 #define _HAPR_ADC
 
@@ -29,15 +36,80 @@
 #include "lpc_types.h"
 #include "lpc17xx_pinsel.h"
 #include "lpc17xx_adc.h"
+#include "lpc17xx_gpdma.h"
+#include "lpc17xx_timer.h"
 
+#include "adc.h"
 #include "filter_chain.h"
 #include "queue.h"
 
+// Decimate the next group of conversions the DMA has written into adc_frame, or
+// leave it as it was if no group is complete yet. Called once per sample, so
+// filters reading any number of channels share a single pass over the ring.
+// marked as inline to allow compiler optimizations
+inline void adc_sample() {
+	uint16_t head = ((uint32_t *)ADC_DMA_CHANNEL->DMACCDestAddr - adc_ring) % ADC_RING_LENGTH;
+	uint16_t ready = (head + ADC_RING_LENGTH - adc_read) % ADC_RING_LENGTH;
+	uint16_t i, c;
+
+	// After audio has stopped for a while the DMA is about to lap the groups not
+	// used yet, which are too old to be worth playing anyway.
+	while (ready > ADC_RING_LENGTH / 2) {
+		adc_read += ADC_OVERSAMPLE;
+		if (adc_read == ADC_RING_LENGTH) {
+			adc_read = 0;
+		}
+		ready -= ADC_OVERSAMPLE;
+	}
+
+	if (ready < ADC_OVERSAMPLE) {
+		return;
+	}
+
+	for (i = 0; i < ADC_OVERSAMPLE; i++) {
+		// the scan converts one channel at a time, the others hold their last
+		// conversion, so every decimator gets ADC_OVERSAMPLE inputs
+		uint32_t word = adc_ring[adc_read + i];
+		uint16_t channel = (word >> 24) & 0x7;
+		if (channel < ADC_CHANNELS) {
+			adc_last[channel] = (word >> 4) & 0xFFF;
+		}
+		for (c = 0; c < ADC_CHANNELS; c++) {
+			if (adc_channels & (1 << c)) {
+				cic_push(&adc_cic[c], adc_last[c]);
+			}
+		}
+	}
+	adc_read += ADC_OVERSAMPLE;
+	if (adc_read == ADC_RING_LENGTH) {
+		adc_read = 0;
+	}
+
+	for (c = 0; c < ADC_CHANNELS; c++) {
+		if (adc_channels & (1 << c)) {
+			adc_frame[c] = cic_pull(&adc_cic[c]);
+		}
+	}
+}
+
+// Decimate channels from the next sample on, on top of ADC_GUITAR_CHANNELS.
+// Decimators which weren't running start again from silence.
+void adc_enable(uint16_t channels)
+{
+	uint16_t c;
+	channels |= ADC_GUITAR_CHANNELS;
+	for (c = 0; c < ADC_CHANNELS; c++) {
+		if ((channels & ~adc_channels) & (1 << c)) {
+			cic_reset(&adc_cic[c]);
+		}
+	}
+	adc_channels = channels;
+}
+
+// The guitar input, both of its channels mixed.
 // marked as inline to allow compiler optimizations
 inline uint16_t adc_get_data() {
-	uint16_t v0 = ADC_ChannelGetData(LPC_ADC, ADC_CHANNEL_0) & 0xFFF;
-	uint16_t v1 = ADC_ChannelGetData(LPC_ADC, ADC_CHANNEL_1) & 0xFFF;
-	uint16_t v = (v0 + v1) / 2;
+	uint16_t v = (adc_frame[0] + adc_frame[1]) / 2;
 
 	#if DEBUG==1 && TRACE==1
 	tty_writeln_int(v);
@@ -52,6 +124,19 @@ inline uint16_t adc_get_scramble_data() {
 	return v2;
 }
 
+// Pace the DMA to the sample period, in us (see timer.c). Timer 1
+// counts a whole number of ticks for each conversion taken, so the conversions
+// never drift against the samples.
+void adc_rate(uint32_t period)
+{
+	TIM_Cmd(LPC_TIM1, DISABLE);
+	LPC_TIM1->MR0 = TIMER_TICKS_PER_US * period / ADC_OVERSAMPLE - 1;
+	TIM_ResetCounter(LPC_TIM1);
+	// a request may be pending from before, cleared as if it were an interrupt
+	LPC_TIM1->IR = 1;
+	TIM_Cmd(LPC_TIM1, ENABLE);
+}
+
 void adc_init()
 {
 	PINSEL_CFG_Type PinCfg0;
@@ -84,6 +169,50 @@ void adc_init()
 	ADC_ChannelCmd(LPC_ADC, ADC_CHANNEL_0, ENABLE);
 	ADC_ChannelCmd(LPC_ADC, ADC_CHANNEL_1, ENABLE);
 	ADC_ChannelCmd(LPC_ADC, ADC_CHANNEL_2, ENABLE);
+
+	// Timer 1 only makes DMA requests, its match is never an interrupt.
+	TIM_TIMERCFG_Type TIM_ConfigStruct;
+	TIM_MATCHCFG_Type TIM_MatchConfigStruct;
+	TIM_ConfigStruct.PrescaleOption = TIM_PRESCALE_TICKVAL;
+	TIM_ConfigStruct.PrescaleValue = 1;
+	TIM_MatchConfigStruct.MatchChannel = 0;
+	TIM_MatchConfigStruct.IntOnMatch = FALSE;
+	TIM_MatchConfigStruct.ResetOnMatch = TRUE;
+	TIM_MatchConfigStruct.StopOnMatch = FALSE;
+	TIM_MatchConfigStruct.ExtMatchOutputType = TIM_EXTMATCH_NOTHING;
+	TIM_MatchConfigStruct.MatchValue = 0; // set by adc_rate(), from timer_init()
+	TIM_Init(LPC_TIM1, TIM_TIMER_MODE, &TIM_ConfigStruct);
+	TIM_ConfigMatch(LPC_TIM1, &TIM_MatchConfigStruct);
+
+	// The ring is refilled for ever by a linked list item which links to itself.
+	static GPDMA_LLI_Type adc_lli;
+	adc_ring = (uint32_t *)AUDIO_DMA_BASE;
+	adc_lli.SrcAddr = (uint32_t)&LPC_ADC->ADGDR;
+	adc_lli.DstAddr = (uint32_t)adc_ring;
+	adc_lli.NextLLI = (uint32_t)&adc_lli;
+	adc_lli.Control = GPDMA_DMACCxControl_TransferSize(ADC_RING_LENGTH) |
+		GPDMA_DMACCxControl_SBSize(GPDMA_BSIZE_1) | GPDMA_DMACCxControl_DBSize(GPDMA_BSIZE_1) |
+		GPDMA_DMACCxControl_SWidth(GPDMA_WIDTH_WORD) | GPDMA_DMACCxControl_DWidth(GPDMA_WIDTH_WORD) |
+		GPDMA_DMACCxControl_DI;
+
+	// silence, the 0 amplitude level, until the first conversions arrive
+	uint16_t c;
+	for (c = 0; c < ADC_CHANNELS; c++) {
+		cic_reset(&adc_cic[c]);
+		adc_last[c] = adc_frame[c] = 2000;
+	}
+	adc_channels = ADC_GUITAR_CHANNELS;
+	adc_read = 0;
+
+	GPDMA_Init();
+	LPC_SC->DMAREQSEL |= ADC_DMA_REQSEL;
+	ADC_DMA_CHANNEL->DMACCSrcAddr = adc_lli.SrcAddr;
+	ADC_DMA_CHANNEL->DMACCDestAddr = adc_lli.DstAddr;
+	ADC_DMA_CHANNEL->DMACCLLI = adc_lli.NextLLI;
+	ADC_DMA_CHANNEL->DMACCControl = adc_lli.Control;
+	ADC_DMA_CHANNEL->DMACCConfig = GPDMA_DMACCxConfig_E |
+		GPDMA_DMACCxConfig_SrcPeripheral(ADC_DMA_REQUEST) |
+		GPDMA_DMACCxConfig_TransferType(GPDMA_TRANSFERTYPE_P2M);
 }
 
 #endif
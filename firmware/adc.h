@@ -1,8 +1,31 @@
 #ifndef _HAPR_ADC_H
 #define _HAPR_ADC_H
 
+#include "cic.h"
+#include "timer.h"
+
+// Conversions of the guitar channels are copied by the GPDMA into a ring, paced by
+// timer 1 at ADC_OVERSAMPLE times the sample rate, and decimated by a CIC filter.
+#define ADC_CHANNELS 3 // Channels converted: 0 and 1 guitar, 2 microphone.
+#define ADC_GUITAR_CHANNELS 0x3 // Always decimated, the input filter and bypass mix them.
+#define ADC_OVERSAMPLE CIC_DECIMATION // Conversions taken for each sample.
+#define ADC_RING_LENGTH (4 * AUDIO_BLOCK * ADC_OVERSAMPLE) // Words in the ring, room for the conversions of four blocks.
+#define ADC_DMA_CHANNEL LPC_GPDMACH1 // Channel 0 has the highest priority, left for output.
+#define ADC_DMA_REQUEST 10 // GPDMA request line of timer 1 match 0 ...
+#define ADC_DMA_REQSEL (1<<2) // ... once selected over UART1 Tx in DMAREQSEL.
+
+uint32_t *adc_ring; // ADGDR as the DMA read it, result and channel number. In AHB SRAM at AUDIO_DMA_BASE.
+uint16_t adc_read; // Index of the next word of adc_ring to decimate, always at the start of a group.
+uint16_t adc_channels; // Bit n set to decimate channel n: ADC_GUITAR_CHANNELS and any channel filters read.
+uint16_t adc_last[ADC_CHANNELS]; // Last conversion of each channel, held until its next one.
+uint16_t adc_frame[ADC_CHANNELS]; // The current sample of every channel, filled once per sample by adc_sample().
+struct cic adc_cic[ADC_CHANNELS];
+
+inline void adc_sample();
+void adc_enable(uint16_t channels);
 inline uint16_t adc_get_data();
 inline uint16_t adc_get_scramble_data();
+void adc_rate(uint32_t period);
 void adc_init();
 
-#endif
\ No newline at end of file
+#endif
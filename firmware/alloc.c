@@ -4,9 +4,15 @@
 #include "math.h"
 #include "stdio.h"
 #include "stdlib.h"
+#include "string.h"
 
+#include "profile.h"
+#include "adc.h"
 #include "alloc.h"
+#include "capture.h"
+#include "preset.h"
 #include "serial.h"
+#include "timer.h"
 #include "queue.h"
 
 // Originally we made use of malloc, but with no ability to control how memory
@@ -19,13 +25,11 @@
 // as neither peripheral is used in this solution. We presently can store over 22000
 // samples at any given time, versus only 6000 or so using the previous solution.
 
-// The buffer allocation functions for samples still return only contiguous memory,
-// however in even experimental usage we have almost never found this an issue. Since
-// the system recreates all filters when the graph is changed, this is impossible to
-// encounter when using even 100 of the currently used filters (which CPU constraints
-// would make impossible). Issues like wasting memory when less than BUF_BLOCK_LENGTH
-// samples are wanted in a buffer also would need addressing if memory issues became
-// a constraint again.
+// Sample buffers are ring buffers whose lengths are powers of two, so each sample
+// pool is managed as a buddy allocator with one size class per power of two from
+// BUF_BLOCK_LENGTH upwards. Freed buffers are merged back with their buddies, so
+// filters can be freed and created one at a time without the pools fragmenting,
+// and nothing needs free_all_buf() to get contiguous memory back.
 
 // 2014-02-22 Created by Michael Mokrysz to allocate sample buffers YYYY-MM-DD
 // 2014-02-25 Modified by Michael Mokrysz to store extra samples in Ethernet/USB reserved 32KB of RAM
@@ -33,334 +37,836 @@
 // 2014-03-04 Modified by Michael Mokrysz in major refactoring and bug elimination
 // 2014-03-06 Modified by Michael Mokrysz to allocate various structs
 
+// Capacities of the struct pools, can be overridden at build time. The first
+// sample array grows or shrinks by however much memory that frees or takes.
+#ifndef FILTER_ALLOC_SIZE
 #define FILTER_ALLOC_SIZE 100 // How many filter structs to allocate.
+#endif
+#ifndef QUEUE_ALLOC_SIZE
 #define QUEUE_ALLOC_SIZE 100 // How many queue structs to allocate.
+#endif
+#ifndef QUEUE_ELEMENT_ALLOC_SIZE
 #define QUEUE_ELEMENT_ALLOC_SIZE 100 // How many queue_element structs to allocate.
-#define BUF_BLOCK_LENGTH (1<<7) // How many samples in one allocation block.
-#define BUF_BLOCK_SIZE (BUF_BLOCK_LENGTH * sizeof(uint16_t)) // Size of a sample allocation block in bytes.
-#define BUF1_LENGTH (10240-5608) // Size of first sample array, must be multiple of BUF_BLOCK_LENGTH.
-#define BUF2_LENGTH (1<<14) // Size of second sample array, stored in Ethernet memory. Must be multiple of BUF_BLOCK_LENGTH
+#endif
+#define ALLOC_POISON 0xA5 // Byte freed structs are filled with when compiled with ALLOC_VALIDATE.
+#define BUF_BLOCK_LENGTH (1<<4) // How many samples in the smallest allocation, the smallest ring buffer.
+#define BUF_ORDERS 11 // Number of buddy size classes, BUF_BLOCK_LENGTH << (BUF_ORDERS-1) is the largest.
+// Bytes taken by struct pools of the given capacities.
+#define STRUCT_POOL_BYTES(filters, queues, queue_elements) ((int32_t)( \
+	(filters) * sizeof(struct filter) + \
+	(queues) * sizeof(struct queue) + \
+	(queue_elements) * sizeof(struct queue_element)))
+// Bytes of the 32KB of main memory shared by the struct pools and the first sample
+// array: what they took when the pools were laid out, 100 filters of 56 bytes, 100
+// queues of 12 and 100 queue elements of 8 with a byte of mask each, next to
+// 10240-5608 samples.
+#define POOL_RAM_BYTES (100 * (56 + 12 + 8 + 3) + (10240 - 5608) * 2)
+// Size of first sample array: what is left of POOL_RAM_BYTES by the struct pools as
+// they are built, the serial frame buffer (see serial.h) and the flash page buffer
+// (see preset.h), rounded down to a multiple of BUF_BLOCK_LENGTH. Structs that grow
+// take their memory from here.
+#define BUF1_LENGTH (((POOL_RAM_BYTES - \
+	STRUCT_POOL_BYTES(FILTER_ALLOC_SIZE, QUEUE_ALLOC_SIZE, QUEUE_ELEMENT_ALLOC_SIZE) - \
+	FRAME_MAX_PAYLOAD - PRESET_PAGE_SIZE) / 2) & ~(BUF_BLOCK_LENGTH - 1))
+#define BUF2_LENGTH ((1<<14) - AUDIO_DMA_BYTES / 2) // Size of second sample array, stored in Ethernet memory, less the audio DMA buffers after it (see timer.h). Must be multiple of BUF_BLOCK_LENGTH
 #define BUF1_BLOCK_LENGTH (BUF1_LENGTH / BUF_BLOCK_LENGTH) // Length of first sample array.
 #define BUF2_BLOCK_LENGTH (BUF2_LENGTH / BUF_BLOCK_LENGTH) // Length of second sample array.
+// How the first sample buffer of a filter stores its samples. Only delay lines use
+// anything but plain storage, trading precision for length.
+#define BUF_STORAGE_PLAIN 0 // One sample in each uint16_t.
+#define BUF_STORAGE_PACKED 1 // 12-bit samples, two in every three bytes. A third longer.
+#define BUF_STORAGE_ULAW 2 // 8-bit mu-law companded samples, one in each byte. Twice as long.
+// Words (of 16 bits) taken by a packed ring of the given length, and the length
+// of the packed ring which fits in the given number of words.
+#define PACKED_WORDS(samples) (((samples) * 3 + 3) / 4)
+#define PACKED_SAMPLES(words) (((words) * 4) / 3)
+// The same for mu-law rings.
+#define ULAW_WORDS(samples) (((samples) + 1) / 2)
+#define ULAW_SAMPLES(words) ((words) * 2)
+#define ULAW_BIAS 0x84 // Added to magnitudes before companding, as in G.711.
+#define ULAW_CLIP 32635 // Largest magnitude which can be companded.
+// Words needed for the free bitmaps of every order of a pool of the given number of
+// blocks: at most two bits per block in total, plus a partial word per order.
+#define BUF_FREE_WORDS(blocks) ((blocks) / 16 + BUF_ORDERS)
+
+// The structs of a filter graph come from fixed size pools, one per struct type.
+// Each pool hands out its entries in order, and entries which are freed go on an
+// intrusive free list, linked through their first word, to be handed out again
+// first. Both are O(1). Freeing the whole pool just resets it, which is also how a
+// failed build is rolled back to a checkpoint (see alloc_rollback).
+struct alloc_pool
+{
+	uint16_t top; // Index of the first entry never handed out since the pool was emptied.
+	uint16_t live; // Entries currently allocated.
+	uint16_t live_max; // Most entries allocated at once since boot.
+	void *free_list; // Freed entries below top, most recently freed first.
+};
+
+// Instantiate a pool of capacity structs of a type: the entries, the bookkeeping
+// and typed name_pool_alloc(), name_pool_free(), name_pool_free_all() and
+// name_pool_live(). New entries are blank. Walks over the entries below top must
+// skip those which aren't live, as entries can be freed on their own.
+#define ALLOC_POOL(type, name, capacity) \
+struct type name##_alloc_pool[capacity]; \
+struct alloc_pool name##_alloc; \
+static const struct type name##_empty; \
+\
+struct type *name##_pool_alloc() \
+{ \
+	struct type *entry = alloc_pool_take(&name##_alloc, name##_alloc_pool, sizeof(struct type), capacity); \
+	if (entry != NULL) { \
+		*entry = name##_empty; \
+	} \
+	return entry; \
+} \
+\
+void name##_pool_free(struct type *entry) \
+{ \
+	alloc_pool_give(&name##_alloc, name##_alloc_pool, sizeof(struct type), entry); \
+} \
+\
+void name##_pool_free_all() \
+{ \
+	alloc_pool_reset(&name##_alloc, 0); \
+} \
+\
+uint8_t name##_pool_live(struct type *entry) \
+{ \
+	return alloc_pool_live(&name##_alloc, entry); \
+}
+
+// Number of frees of memory that wasn't allocated, or of pointers outside of the
+// pools, and of freed structs written to, caught when compiled with ALLOC_VALIDATE.
+uint32_t alloc_errors = 0;
 
-// A blank filter struct used to blank deallocating filters.
-static const struct filter EMPTY_FILTER;
-// Pool of filter structs to use for allocation.
-struct filter filter_alloc_pool[FILTER_ALLOC_SIZE];
-// Allocation booleans of filter structs.
-uint8_t filter_alloc_mask[FILTER_ALLOC_SIZE];
-
-// A blank queue struct used to blank deallocating queues.
-static const struct queue EMPTY_QUEUE;
-// Pool of queue structs to use for allocation.
-struct queue queue_alloc_pool[QUEUE_ALLOC_SIZE];
-// Allocation booleans of queue structs.
-uint8_t queue_alloc_mask[QUEUE_ALLOC_SIZE];
-
-// A blank queue_element used to blank deallocating filters.
-static const struct queue_element EMPTY_QUEUE_ELEMENT;
-// Pool of queue_element structs to use for allocation.
-struct queue_element queue_element_alloc_pool[QUEUE_ELEMENT_ALLOC_SIZE];
-// Allocation booleans of filter queue_elements.
-uint8_t queue_element_alloc_mask[QUEUE_ELEMENT_ALLOC_SIZE];
+// Check a freed entry still holds nothing but poison after its free list link.
+uint8_t alloc_pool_poisoned(uint8_t *entry, uint32_t entry_size)
+{
+	uint32_t i;
+	for (i = sizeof(void *); i < entry_size; i++) {
+		if (entry[i] != ALLOC_POISON) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+// Take an entry off the free list, or else the next one never handed out. NULL
+// when the pool is exhausted.
+void *alloc_pool_take(struct alloc_pool *pool, void *entries, uint32_t entry_size, uint32_t capacity)
+{
+	void *entry;
+	if (pool->free_list != NULL) {
+		entry = pool->free_list;
+		pool->free_list = *(void **)entry;
+		#if ALLOC_VALIDATE==1
+		if (!alloc_pool_poisoned(entry, entry_size)) {
+			alloc_errors++;
+			#if DEBUG==1
+			tty_writeln("ERROR: struct written to after being freed");
+			#endif
+		}
+		#endif
+	} else if (pool->top < capacity) {
+		entry = (uint8_t *)entries + pool->top++ * entry_size;
+	} else {
+		return NULL;
+	}
+	pool->live++;
+	if (pool->live > pool->live_max) {
+		pool->live_max = pool->live;
+	}
+	return entry;
+}
+
+// Put an entry on the free list of its pool.
+void alloc_pool_give(struct alloc_pool *pool, void *entries, uint32_t entry_size, void *entry)
+{
+	#if ALLOC_VALIDATE==1
+	uint32_t offset = (uint8_t *)entry - (uint8_t *)entries;
+	if ((uint8_t *)entry < (uint8_t *)entries || offset >= pool->top * entry_size
+			|| offset % entry_size != 0 || alloc_pool_poisoned(entry, entry_size)) {
+		alloc_errors++;
+		#if DEBUG==1
+		tty_writeln("ERROR: free of a struct which isn't allocated");
+		#endif
+		return;
+	}
+	memset((uint8_t *)entry + sizeof(void *), ALLOC_POISON, entry_size - sizeof(void *));
+	#endif
+	*(void **)entry = pool->free_list;
+	pool->free_list = entry;
+	pool->live--;
+}
+
+// Is an entry below top allocated, rather than on the free list? The free list
+// only holds structs which were freed on their own, so it is usually empty.
+uint8_t alloc_pool_live(struct alloc_pool *pool, void *entry)
+{
+	void *freed;
+	for (freed = pool->free_list; freed != NULL; freed = *(void **)freed) {
+		if (freed == entry) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+// Release every entry from index top upwards. Only valid when none of them are on
+// the free list, which holds when the free list was empty as they were allocated.
+void alloc_pool_reset(struct alloc_pool *pool, uint16_t top)
+{
+	pool->live -= pool->top - top;
+	pool->top = top;
+	if (top == 0) {
+		pool->free_list = NULL;
+	}
+}
+
+ALLOC_POOL(filter, filter, FILTER_ALLOC_SIZE)
+ALLOC_POOL(queue, queue, QUEUE_ALLOC_SIZE)
+ALLOC_POOL(queue_element, queue_element, QUEUE_ELEMENT_ALLOC_SIZE)
 
 // First pool of audio samples, stored in spare space in the ordinary 32KB of memory.
 uint16_t buf1_pool[BUF1_LENGTH];
-// This second buf alloc pool utilises the 32K of memory normally reserved for the
+// Fails to build if the struct pools leave no block of it, rather than overflowing main memory.
+typedef char buf1_pool_fits[BUF1_LENGTH >= BUF_BLOCK_LENGTH ? 1 : -1];
+// The second pool (buf2 below) utilises the 32K of memory normally reserved for the
 // Ethernet and USB. Need to disable/alter this if we use either.
-uint16_t *buf2_pool = (uint16_t *)(0x2007C000);
 
-// Allocation booleans for each of the sample pools. Samples are allocated in blocks
-// of 100, in order to minimise overhead in the masks.
-uint8_t buf1_mask[BUF1_BLOCK_LENGTH];
-uint8_t buf2_mask[BUF2_BLOCK_LENGTH];
+// A sample pool managed as a buddy allocator. A buffer of order k is
+// BUF_BLOCK_LENGTH << k samples long and starts at a multiple of its own length
+// from the start of the pool. For each order there is a free bitmap with one bit
+// per possible buffer of that order, set when it is free. Keeping them as words
+// lets the allocator skip 32 buffers at a time with a single count-trailing-zeros.
+struct buf_pool
+{
+	uint16_t *base; // First sample of the pool.
+	uint32_t blocks; // Length of the pool in BUF_BLOCK_LENGTH blocks.
+	uint32_t *free; // Free bitmaps of every order, one after the other.
+	uint16_t free_offset[BUF_ORDERS]; // Index in free of the bitmap of each order.
+	uint16_t free_words[BUF_ORDERS]; // Words in the bitmap of each order.
+	uint32_t used; // Samples allocated.
+	uint32_t used_max; // Most samples allocated at once since boot.
+};
+
+// Free bitmaps of each of the sample pools.
+uint32_t buf1_free[BUF_FREE_WORDS(BUF1_BLOCK_LENGTH)];
+uint32_t buf2_free[BUF_FREE_WORDS(BUF2_BLOCK_LENGTH)];
+
+struct buf_pool buf1 = { buf1_pool, BUF1_BLOCK_LENGTH, buf1_free };
+struct buf_pool buf2 = { (uint16_t *)(0x2007C000), BUF2_BLOCK_LENGTH, buf2_free };
 
 // Initialise filter allocation routines
 void filter_alloc_init()
 {
-	int i;
-	for (i = 0; i < FILTER_ALLOC_SIZE; i++) {
-		filter_alloc_mask[i] = 0;
-	}
+	filter_pool_free_all();
 }
 
-// Allocate a filter struct from the pool.
+// Allocate a blank filter struct, or NULL when the pool is exhausted.
 struct filter *alloc_filter()
 {
-	int i;
-	for (i = 0; i < FILTER_ALLOC_SIZE; i++) {
-		if (filter_alloc_mask[i] == 0) {
-			filter_alloc_mask[i] = 1;
+	return filter_pool_alloc();
+}
 
-			return &filter_alloc_pool[i];
-		}
+// Words taken by the first sample buffer of a filter.
+uint32_t filter_buf0_words(struct filter *f)
+{
+	if (f->buf0_storage == BUF_STORAGE_PACKED) {
+		return PACKED_WORDS(f->buf0_size);
+	}
+	if (f->buf0_storage == BUF_STORAGE_ULAW) {
+		return ULAW_WORDS(f->buf0_size);
+	}
+	return f->buf0_size;
+}
+
+// Free the sample buffers of a filter.
+void free_filter_bufs(struct filter *f)
+{
+	if (f->buf0 != NULL) {
+		free_buf(f->buf0, filter_buf0_words(f));
+		f->buf0 = NULL;
+	}
+	if (f->buf1 != NULL) {
+		free_buf(f->buf1, f->buf1_size);
+		f->buf1 = NULL;
+	}
+	if (f->fused_table != NULL) {
+		free_buf(f->fused_table, FUSED_TABLE_SIZE);
+		f->fused_table = NULL;
 	}
-	return NULL;
 }
 
-// Free a filter struct in the pool.
+// Free a filter struct in the pool, along with its sample buffers.
 void free_filter(struct filter *f)
 {
-	int filter_index = (f - &filter_alloc_pool[0]) / sizeof(filter_alloc_pool[0]);
-	filter_alloc_pool[filter_index] = EMPTY_FILTER;
-	filter_alloc_mask[filter_index] = 0;
+	free_filter_bufs(f);
+	filter_pool_free(f);
 }
 
-// Free all filter structs. Generally used when soft-resetting firmware.
+// Free all filter structs. Generally used when soft-resetting firmware. Sample
+// buffers only ever belong to filters, so they are all freed too.
 void free_all_filters()
 {
-	uint32_t i;
-	for (i = 0; i < FILTER_ALLOC_SIZE; i++) {
-		if (filter_alloc_mask[i]) {
-			free_filter(&filter_alloc_pool[i]);
-		}
-	}
+	filter_pool_free_all();
+	free_all_buf();
 }
 
 // Count allocated filter structs.
 uint32_t filter_alloced()
 {
-	uint32_t i, used_count = 0;
-	for (i = 0; i < FILTER_ALLOC_SIZE; i++) {
-		used_count += filter_alloc_mask[i];
-	}
-	return used_count;
+	return filter_alloc.live;
 }
 
 // Queue allocation routines
 // Initialise queue struct allocation.
 void queue_alloc_init()
 {
-	int i;
-	for (i = 0; i < QUEUE_ALLOC_SIZE; i++) {
-		queue_alloc_mask[i] = 0;
-	}
+	queue_pool_free_all();
 }
 
-// Allocate an unused queue struct.
+// Allocate a blank queue struct, or NULL when the pool is exhausted.
 struct queue *alloc_queue()
 {
-	int i;
-	for (i = 0; i < QUEUE_ALLOC_SIZE; i++) {
-		if (queue_alloc_mask[i] == 0) {
-			queue_alloc_mask[i] = 1;
-			return &queue_alloc_pool[i];
-		}
-	}
-	return NULL;
+	return queue_pool_alloc();
 }
 
 // Free provided pointer to queue struct.
 void free_queue(struct queue *f)
 {
-	int queue_index = (f - &queue_alloc_pool[0]) / sizeof(queue_alloc_pool[0]);
-	queue_alloc_pool[queue_index] = EMPTY_QUEUE;
-	queue_alloc_mask[queue_index] = 0;
+	queue_pool_free(f);
 }
 
 // Free all queue structs.
 void free_all_queues()
 {
-	uint32_t i;
-	for (i = 0; i < QUEUE_ALLOC_SIZE; i++) {
-		if (queue_alloc_mask[i]) {
-			free_queue(&queue_alloc_pool[i]);
-		}
-	}
+	queue_pool_free_all();
 }
 
 // Count allocated queue structs.
 uint32_t queue_alloced()
 {
-	uint32_t i, used_count = 0;
-	for (i = 0; i < QUEUE_ALLOC_SIZE; i++) {
-		used_count += queue_alloc_mask[i];
-	}
-	return used_count;
+	return queue_alloc.live;
 }
 
 // Queue element allocation routines
 // Initialise queue element allocation.
 void queue_element_alloc_init()
 {
-	int i;
-	for (i = 0; i < QUEUE_ELEMENT_ALLOC_SIZE; i++) {
-		queue_element_alloc_mask[i] = 0;
-	}
+	queue_element_pool_free_all();
 }
 
-// Allocate an unused queue_element struct from the pool.
+// Allocate a blank queue_element struct, or NULL when the pool is exhausted.
 struct queue_element *alloc_queue_element()
 {
-	int i;
-	for (i = 0; i < QUEUE_ELEMENT_ALLOC_SIZE; i++) {
-		if (queue_element_alloc_mask[i] == 0) {
-			queue_element_alloc_mask[i] = 1;
-			return &queue_element_alloc_pool[i];
-		}
-	}
-	return NULL;
+	return queue_element_pool_alloc();
 }
 
 // Free specified queue element.
 void free_queue_element(struct queue_element *f)
 {
-	// Get block index of
-	int queue_element_index = (f - &queue_element_alloc_pool[0]) / sizeof(queue_element_alloc_pool[0]);
-	queue_element_alloc_pool[queue_element_index] = EMPTY_QUEUE_ELEMENT;
-	queue_element_alloc_mask[queue_element_index] = 0;
+	queue_element_pool_free(f);
 }
 
 // Mark every queue_element in pool as unused.
 void free_all_queue_elements()
 {
-	uint32_t i;
-	for (i = 0; i < QUEUE_ELEMENT_ALLOC_SIZE; i++) {
-		if (queue_element_alloc_mask[i]) {
-			free_queue_element(&queue_element_alloc_pool[i]);
-		}
-	}
+	queue_element_pool_free_all();
 }
 
 // Count how many queue_elements are allocated. Could be used to monitor memory usage.
 uint32_t queue_element_alloced()
 {
-	uint32_t i, used_count = 0;
-	for (i = 0; i < QUEUE_ELEMENT_ALLOC_SIZE; i++) {
-		used_count += queue_element_alloc_mask[i];
+	return queue_element_alloc.live;
+}
+
+// Remember how much of each pool is in use, so a graph build can be undone. Take
+// checkpoints with empty free lists, as filter_init() does right after free_all(),
+// so that everything allocated after one lies past it in its pool.
+void alloc_checkpoint(struct alloc_checkpoint *checkpoint)
+{
+	#if ALLOC_VALIDATE==1
+	if (filter_alloc.free_list != NULL || queue_alloc.free_list != NULL
+			|| queue_element_alloc.free_list != NULL) {
+		alloc_errors++;
 	}
-	return used_count;
+	#endif
+	checkpoint->filters = filter_alloc.top;
+	checkpoint->queues = queue_alloc.top;
+	checkpoint->queue_elements = queue_element_alloc.top;
 }
 
-// Initialise sample buffer allocation.
-void buf_alloc_init()
+// Release everything allocated since a checkpoint. Sample buffers are only ever
+// allocated for filters, so freeing those of the filters past the checkpoint gives
+// them back to the buddy allocator, which merges them back to the state they were
+// in. Checkpoints must be rolled back newest first.
+void alloc_rollback(struct alloc_checkpoint *checkpoint)
 {
-	free_all_buf();
+	uint16_t i;
+	for (i = checkpoint->filters; i < filter_alloc.top; i++) {
+		free_filter_bufs(&filter_alloc_pool[i]);
+	}
+	alloc_pool_reset(&filter_alloc, checkpoint->filters);
+	alloc_pool_reset(&queue_alloc, checkpoint->queues);
+	alloc_pool_reset(&queue_element_alloc, checkpoint->queue_elements);
 }
 
-// Attempt to allocate a number of blocks of samples in provided sample buffer.
-uint16_t *alloc_buf_pointed(uint8_t *buf_mask, uint16_t *buf_pool, uint32_t buf_length, uint32_t requested_blocks)
+// Free the whole filter graph: filter and queue structs and the sample buffers.
+// A capture taps a filter of the graph, so it goes too.
+void free_all()
 {
-	uint32_t i, current_blocks_length = 0, current_blocks_start = 0;
-	// Iterate over length of buffer mask, looking for enough free blocks.
-	for (i = 0; i < buf_length; i++) {
-		// If block is used, keep iterating.
-		if (buf_mask[i] != 0) {
-			current_blocks_length = 0;
-			continue;
+	capture_stop();
+	free_all_filters();
+	free_all_queues();
+	free_all_queue_elements();
+}
+
+// Set (free) or clear (allocate) a run of bits in a free bitmap, a word at a time.
+void bitmap_assign(uint32_t *bitmap, uint32_t start, uint32_t count, uint8_t free)
+{
+	while (count > 0) {
+		uint32_t bit = start & 31;
+		uint32_t bits = 32 - bit;
+		if (bits > count) {
+			bits = count;
 		}
+		uint32_t mask = (bits == 32 ? 0xFFFFFFFF : ((1UL << bits) - 1)) << bit;
 
-		// If this is the first unused block, set start index of contiguous blocks.
-		if (current_blocks_length == 0) {
-			current_blocks_start = i;
+		if (free) {
+			bitmap[start >> 5] |= mask;
+		} else {
+			bitmap[start >> 5] &= ~mask;
 		}
-		// Increment how many contiguous blocks are unused.
-		current_blocks_length++;
-
-		// If we have enough contiguous free blocks, mark them as allocated and return a pointer.
-		if (current_blocks_length >= requested_blocks) {
-			uint32_t j;
-			for (j = current_blocks_start; j < current_blocks_start + requested_blocks; j++) {
-				buf_mask[j] = 1;
+
+		start += bits;
+		count -= bits;
+	}
+}
+
+// Check that every bit of a run in a free bitmap is set (free) or clear (allocated).
+uint8_t bitmap_check(uint32_t *bitmap, uint32_t start, uint32_t count, uint8_t free)
+{
+	while (count > 0) {
+		uint32_t bit = start & 31;
+		uint32_t bits = 32 - bit;
+		if (bits > count) {
+			bits = count;
+		}
+		uint32_t mask = (bits == 32 ? 0xFFFFFFFF : ((1UL << bits) - 1)) << bit;
+		uint32_t expected = free ? mask : 0;
+
+		if ((bitmap[start >> 5] & mask) != expected) {
+			return 0;
+		}
+
+		start += bits;
+		count -= bits;
+	}
+	return 1;
+}
+
+// Index of the first set bit in a free bitmap of the given number of words, or -1.
+int32_t bitmap_find_first(uint32_t *bitmap, uint32_t words)
+{
+	uint32_t i;
+	for (i = 0; i < words; i++) {
+		if (bitmap[i] != 0) {
+			return (i << 5) + __builtin_ctz(bitmap[i]);
+		}
+	}
+	return -1;
+}
+
+// Order of the smallest buddy buffer holding the given number of samples.
+uint32_t buf_order(uint32_t samples)
+{
+	uint32_t blocks = (samples + BUF_BLOCK_LENGTH - 1) / BUF_BLOCK_LENGTH;
+	if (blocks <= 1) {
+		return 0;
+	}
+	return 32 - __builtin_clz(blocks - 1);
+}
+
+// Number of possible buffers of an order in a pool.
+#define BUF_POOL_INDEXES(pool, order) ((pool)->blocks >> (order))
+
+// Test, set or clear the free bit of the buffer at index of order.
+#define BUF_POOL_BIT(pool, order, index) \
+	((pool)->free[(pool)->free_offset[order] + ((index) >> 5)] & (1UL << ((index) & 31)))
+#define BUF_POOL_SET(pool, order, index) \
+	((pool)->free[(pool)->free_offset[order] + ((index) >> 5)] |= (1UL << ((index) & 31)))
+#define BUF_POOL_CLEAR(pool, order, index) \
+	((pool)->free[(pool)->free_offset[order] + ((index) >> 5)] &= ~(1UL << ((index) & 31)))
+
+// Lay out the bitmaps of a pool and mark the whole pool free. Pools which aren't a
+// power of two long are split into the largest aligned buffers that fit, which
+// are never merged with anything past the end of the pool.
+void buf_pool_init(struct buf_pool *pool)
+{
+	uint32_t order, offset = 0;
+	for (order = 0; order < BUF_ORDERS; order++) {
+		pool->free_offset[order] = offset;
+		pool->free_words[order] = (BUF_POOL_INDEXES(pool, order) + 31) / 32;
+		offset += pool->free_words[order];
+	}
+	while (offset > 0) {
+		pool->free[--offset] = 0;
+	}
+	pool->used = 0;
+
+	uint32_t block = 0;
+	while (block < pool->blocks) {
+		order = BUF_ORDERS - 1;
+		while ((block & ((1UL << order) - 1)) != 0 || block + (1UL << order) > pool->blocks) {
+			order--;
+		}
+		BUF_POOL_SET(pool, order, block >> order);
+		block += 1UL << order;
+	}
+}
+
+// Allocate a buffer of the given order from a pool. The smallest free buffer of at
+// least that order is taken and split in halves down to the requested order, the
+// unused halves going back on the free bitmaps. O(log n) in the size of the pool.
+uint16_t *buf_pool_alloc(struct buf_pool *pool, uint32_t order)
+{
+	uint32_t found;
+	int32_t index = -1;
+	for (found = order; found < BUF_ORDERS; found++) {
+		index = bitmap_find_first(&pool->free[pool->free_offset[found]], pool->free_words[found]);
+		if (index >= 0) {
+			break;
+		}
+	}
+	if (index < 0) {
+		return NULL;
+	}
+
+	BUF_POOL_CLEAR(pool, found, index);
+	while (found > order) {
+		found--;
+		index <<= 1;
+		BUF_POOL_SET(pool, found, index + 1);
+	}
+
+	pool->used += BUF_BLOCK_LENGTH << order;
+	if (pool->used > pool->used_max) {
+		pool->used_max = pool->used;
+	}
+	return &pool->base[(index << order) * BUF_BLOCK_LENGTH];
+}
+
+// Check a buffer is allocated: none of the free bits of it, of its halves or of
+// the buffers containing it may be set.
+uint8_t buf_pool_check(struct buf_pool *pool, uint32_t block, uint32_t order)
+{
+	uint32_t o;
+	if ((block & ((1UL << order) - 1)) != 0 || block + (1UL << order) > pool->blocks) {
+		return 0;
+	}
+	for (o = 0; o < BUF_ORDERS; o++) {
+		if (o <= order) {
+			if (!bitmap_check(&pool->free[pool->free_offset[o]], block >> o, 1UL << (order - o), 0)) {
+				return 0;
 			}
-			return &buf_pool[current_blocks_start * BUF_BLOCK_LENGTH];
+		} else if (BUF_POOL_BIT(pool, o, block >> o)) {
+			return 0;
 		}
 	}
-	return NULL;
+	return 1;
+}
+
+// Return a buffer to a pool, merging it with its buddy for as long as the buddy is
+// free too. O(log n) in the size of the pool.
+void buf_pool_free(struct buf_pool *pool, uint16_t *b, uint32_t order)
+{
+	uint32_t block = (b - pool->base) / BUF_BLOCK_LENGTH;
+
+	#if ALLOC_VALIDATE==1
+	if (!buf_pool_check(pool, block, order)) {
+		alloc_errors++;
+		#if DEBUG==1
+		tty_writeln("ERROR: free_buf of a buffer which isn't allocated:");
+		tty_writeln_int(block);
+		tty_writeln_int(order);
+		#endif
+		return;
+	}
+	#endif
+
+	pool->used -= BUF_BLOCK_LENGTH << order;
+	uint32_t index = block >> order;
+	while (order < BUF_ORDERS - 1) {
+		uint32_t buddy = index ^ 1;
+		if (buddy >= BUF_POOL_INDEXES(pool, order) || !BUF_POOL_BIT(pool, order, buddy)) {
+			break;
+		}
+		BUF_POOL_CLEAR(pool, order, buddy);
+		index >>= 1;
+		order++;
+	}
+	BUF_POOL_SET(pool, order, index);
+}
+
+// Count free samples in a pool.
+uint32_t buf_pool_free_samples(struct buf_pool *pool)
+{
+	uint32_t order, i, free_blocks = 0;
+	for (order = 0; order < BUF_ORDERS; order++) {
+		uint32_t *bitmap = &pool->free[pool->free_offset[order]];
+		for (i = 0; i < pool->free_words[order]; i++) {
+			free_blocks += __builtin_popcount(bitmap[i]) << order;
+		}
+	}
+	return free_blocks * BUF_BLOCK_LENGTH;
+}
+
+// Length in samples of the largest buffer a pool can currently allocate.
+uint32_t buf_pool_largest_free(struct buf_pool *pool)
+{
+	int32_t order;
+	for (order = BUF_ORDERS - 1; order >= 0; order--) {
+		if (bitmap_find_first(&pool->free[pool->free_offset[order]], pool->free_words[order]) >= 0) {
+			return BUF_BLOCK_LENGTH << order;
+		}
+	}
+	return 0;
+}
+
+// Fragmentation of a pool in percent: how much of its free memory can't be had as
+// one buffer. 0 when all the free memory is a single buffer.
+uint32_t buf_pool_fragmentation(struct buf_pool *pool)
+{
+	uint32_t free_samples = buf_pool_free_samples(pool);
+	if (free_samples == 0) {
+		return 0;
+	}
+	return 100 - (buf_pool_largest_free(pool) * 100) / free_samples;
+}
+
+// Check whether a block of a pool is free, as part of a free buffer of any order.
+uint8_t buf_pool_block_free(struct buf_pool *pool, uint32_t block)
+{
+	uint32_t order;
+	for (order = 0; order < BUF_ORDERS; order++) {
+		if ((block >> order) < BUF_POOL_INDEXES(pool, order) && BUF_POOL_BIT(pool, order, block >> order)) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+// Draw a map of a pool into cells characters (plus a terminating NUL), each
+// covering an equal share of its blocks: '.' when all free, '#' when all
+// allocated and ':' when partly allocated.
+void buf_pool_map(struct buf_pool *pool, char *map, uint32_t cells)
+{
+	uint32_t cell, block;
+	for (cell = 0; cell < cells; cell++) {
+		uint32_t first = (pool->blocks * cell) / cells;
+		uint32_t last = (pool->blocks * (cell + 1)) / cells;
+		uint32_t free_blocks = 0;
+		for (block = first; block < last; block++) {
+			free_blocks += buf_pool_block_free(pool, block);
+		}
+		if (free_blocks == last - first) {
+			map[cell] = '.';
+		} else if (free_blocks == 0) {
+			map[cell] = '#';
+		} else {
+			map[cell] = ':';
+		}
+	}
+	map[cells] = 0;
+}
+
+// Initialise sample buffer allocation.
+void buf_alloc_init()
+{
+	free_all_buf();
 }
 
-// Allocate a certain length of sample buffer.
+// Allocate a sample buffer of at least requested_buf samples, rounded up to a
+// power of two (ring buffers already are).
 uint16_t *alloc_buf(uint32_t requested_buf)
 {
 	uint16_t *buf;
-	// How many blocks (each corresponding to an entry in bufN_mask) are requested.
-	// @improvement: fix requesting half a block of memory getting 0 blocks in neater way
-	// than always allocating an extra block.
-	uint32_t requested_blocks = (requested_buf / BUF_BLOCK_LENGTH) + 1;
-	// Try to allocate enough blocks in the first sample buffer.
-	buf = alloc_buf_pointed(&buf1_mask[0], &buf1_pool[0], BUF1_BLOCK_LENGTH, requested_blocks);
+	uint32_t order = buf_order(requested_buf);
+	// Try to allocate in the first sample buffer.
+	buf = buf_pool_alloc(&buf1, order);
 	if (buf == NULL) {
 		// If couldn't allocate in first sample buffer, try allocating in the second.
-		buf = alloc_buf_pointed(&buf2_mask[0], &buf2_pool[0], BUF2_BLOCK_LENGTH, requested_blocks);
+		buf = buf_pool_alloc(&buf2, order);
 	}
 	#if DEBUG==1
 	// If compiled in debug mode, print to serial if allocation fails.
 	if (buf == NULL) {
-		tty_writeln("ERROR: alloc_buf failed for this much memory and blocks:");
+		tty_writeln("ERROR: alloc_buf failed for this much memory, order and fragmentation:");
 		tty_writeln_int(requested_buf);
-		tty_writeln_int(requested_blocks);
+		tty_writeln_int(order);
+		tty_writeln_int(buf_pool_fragmentation(&buf1));
+		tty_writeln_int(buf_pool_fragmentation(&buf2));
 	}
 	#endif
 	return buf;
 }
 
-// Frees a certain section of the second sample buffer.
-void free_buf2(uint16_t *b, uint32_t buf_size)
+// Free a buffer of buf_size samples returned by alloc_buf. Which pool it came from
+// is determined by the pointer.
+void free_buf(uint16_t *b, uint32_t buf_size)
 {
-	int i, buf_index = (b - &buf2_pool[0]) / BUF_BLOCK_SIZE;
-	for (i = 0; i < buf_size; i++) {
-		buf2_mask[buf_index + i] = 0;
+	uint32_t order = buf_order(buf_size);
+	if (b >= &buf1.base[0] && b < &buf1.base[BUF1_LENGTH]) {
+		buf_pool_free(&buf1, b, order);
+	} else if (b >= &buf2.base[0] && b < &buf2.base[BUF2_LENGTH]) {
+		buf_pool_free(&buf2, b, order);
+	} else {
+		#if ALLOC_VALIDATE==1
+		alloc_errors++;
+		#endif
+		#if DEBUG==1
+		tty_writeln("ERROR: free_buf of a pointer outside the sample pools");
+		#endif
 	}
 }
 
-// Free a certain section of the sample buffers. Assumes provided array is all of
-// the underlying buffer blocks, valid in our solution since we never subdivide the
-// arrays returned by alloc_buf.
-// If a sample is in the second buffer (as determined by the pointer being after the
-// end of buf0, which is in the lower half of RAM) continue with a function for that.
-void free_buf(uint16_t *b, uint32_t buf_size)
+// Free all buffers (non-recursively). Used when performing a soft system reset.
+// Filters free their own buffers one at a time, free_all_filters() uses this to
+// free them all at once.
+void free_all_buf()
 {
-	int i, buf_index = (b - &buf1_pool[0]) / BUF_BLOCK_SIZE;
-	if (buf_index > BUF1_BLOCK_LENGTH) {
-		return free_buf2(b, buf_size);
+	buf_pool_init(&buf1);
+	buf_pool_init(&buf2);
+}
+
+// Count how many samples are allocated in the buffers.
+uint32_t buf_alloced()
+{
+	return buf1.used + buf2.used;
+}
+
+// Count the samples (words) allocated to the buffers of a filter, including what
+// the buddy allocator rounded them up by.
+uint32_t filter_samples(struct filter *f)
+{
+	uint32_t samples = 0;
+	if (f->buf0 != NULL) {
+		samples += BUF_BLOCK_LENGTH << buf_order(filter_buf0_words(f));
+	}
+	if (f->buf1 != NULL) {
+		samples += BUF_BLOCK_LENGTH << buf_order(f->buf1_size);
 	}
-	for (i = 0; i < buf_size; i++) {
-		buf1_mask[buf_index + i] = 0;
+	if (f->fused_table != NULL) {
+		samples += BUF_BLOCK_LENGTH << buf_order(FUSED_TABLE_SIZE);
 	}
+	return samples;
 }
 
-// Free all buffers (non-recursively). Used when performing a soft system reset.
-// The use of this instead of recursively finding and freeing all buffers is
-// non-ideal when only a small number of buffers are allocated, but it helps reduce
-// the state to keep track of.
-void free_all_buf()
+// Packed rings aren't a power of two long, so their indexes wrap explicitly
+// rather than being masked. Sample i takes the low or high 12 bits of the two
+// bytes starting at byte i*3/2, depending on whether i is even or odd.
+void packed_buf_write(struct filter *filter, uint16_t val)
 {
-	free_buf(&buf1_pool[0], BUF1_LENGTH);
-	free_buf(&buf2_pool[0], BUF2_LENGTH);
+	uint8_t *bytes = (uint8_t *)filter->buf0;
+	uint16_t i = filter->buf0_head_index;
+	uint32_t b = (i * 3) >> 1;
+
+	// 12-bit samples, saturate what doesn't fit
+	if (val > 0xFFF) {
+		val = 0xFFF;
+	}
+	if (i & 1) {
+		bytes[b] = (bytes[b] & 0x0F) | (val << 4);
+		bytes[b + 1] = val >> 4;
+	} else {
+		bytes[b] = val;
+		bytes[b + 1] = (bytes[b + 1] & 0xF0) | (val >> 8);
+	}
+
+	if (++i == filter->buf0_size) {
+		i = 0;
+	}
+	filter->buf0_head_index = i;
 }
 
-// Write zero to provided array of samples. Used when initialising new sample buffer.
-// Buffer element allocation routines
-void zero_buf(uint16_t *buf, uint16_t buf_size)
+// Read the sample written pos samples before the last one from a packed ring. pos
+// must be less than buf0_size.
+uint16_t packed_buf_read(struct filter *filter, uint16_t pos)
 {
-	uint16_t i;
-	for (i = 0; i < buf_size; i++) {
-		buf[i] = 0;
+	uint8_t *bytes = (uint8_t *)filter->buf0;
+	int32_t i = (int32_t)filter->buf0_head_index - 1 - pos;
+	if (i < 0) {
+		i += filter->buf0_size;
 	}
+	uint32_t b = (i * 3) >> 1;
+	uint16_t v = bytes[b] | (bytes[b + 1] << 8);
+
+	return (i & 1) ? (v >> 4) : (v & 0xFFF);
 }
 
-// Count how many samples are allocated in the buffers.
-uint32_t buf_alloced()
+// Compand a 12-bit sample to 8-bit mu-law as G.711 does, after scaling it to a
+// signed 16-bit value around the middle of the ADC range. A CLZ and a few shifts,
+// whatever the sample.
+uint8_t ulaw_encode(uint16_t val)
+{
+	int32_t pcm = ((int32_t)val - 0x800) << 4;
+	uint8_t sign = 0;
+	if (pcm < 0) {
+		pcm = -pcm;
+		sign = 0x80;
+	}
+	if (pcm > ULAW_CLIP) {
+		pcm = ULAW_CLIP;
+	}
+	pcm += ULAW_BIAS;
+
+	// pcm is at least ULAW_BIAS, so its top bit is between bits 7 and 14
+	uint8_t exponent = (31 - __builtin_clz(pcm)) - 7;
+	uint8_t mantissa = (pcm >> (exponent + 3)) & 0x0F;
+	return ~(sign | (exponent << 4) | mantissa);
+}
+
+// Expand an 8-bit mu-law sample back to 12 bits.
+uint16_t ulaw_decode(uint8_t ulaw)
 {
-	uint16_t i, used_count = 0;
-	for (i = 0; i < BUF1_BLOCK_LENGTH; i++) {
-		used_count += buf1_mask[i];
+	ulaw = ~ulaw;
+	uint8_t exponent = (ulaw >> 4) & 0x07;
+	int32_t pcm = ((((ulaw & 0x0F) << 3) + ULAW_BIAS) << exponent) - ULAW_BIAS;
+	if (ulaw & 0x80) {
+		pcm = -pcm;
 	}
-	for (i = 0; i < BUF2_BLOCK_LENGTH; i++) {
-		used_count += buf2_mask[i];
+	pcm = (pcm >> 4) + 0x800;
+
+	if (pcm > 0xFFF) {
+		return 0xFFF;
 	}
-	return used_count;
+	return pcm;
 }
 
 // Write a value to a specified sample buffer of a given filter struct.
+// Sample buffers aren't zeroed when allocated, instead each one counts how much of
+// it has been written so far and reads further back than that return silence.
 void filter_buf_write(struct filter *filter, uint8_t buf_n, uint16_t val)
 {
 	if (buf_n == 0) {
-		filter->buf0[(filter->buf0_head_index++) & filter->buf0_size_mask] = val;
+		if (filter->buf0_storage == BUF_STORAGE_PLAIN) {
+			filter->buf0[(filter->buf0_head_index++) & filter->buf0_size_mask] = val;
+		} else if (filter->buf0_storage == BUF_STORAGE_PACKED) {
+			packed_buf_write(filter, val);
+		} else {
+			((uint8_t *)filter->buf0)[(filter->buf0_head_index++) & filter->buf0_size_mask] = ulaw_encode(val);
+		}
+		if (filter->buf0_valid < filter->buf0_size) {
+			filter->buf0_valid++;
+		}
 		return;
 	}
 	if (buf_n == 1) {
 		filter->buf1[(filter->buf1_head_index++) & filter->buf1_size_mask] = val;
+		if (filter->buf1_valid < filter->buf1_size) {
+			filter->buf1_valid++;
+		}
 		return;
 	}
 	#if DEBUG==1
@@ -368,13 +874,57 @@ void filter_buf_write(struct filter *filter, uint8_t buf_n, uint16_t val)
 	#endif
 }
 
-// Read the value of a specified sample buffer of a given filter struct.
+// Read the first sample buffer of a filter, which stores samples plainly. That is
+// every filter's but those of delays and reverbs set to compact storage, so most
+// filter functions read through this rather than testing buf_n and the storage.
+uint16_t filter_buf_read_plain(struct filter *filter, uint16_t pos)
+{
+	if (pos >= filter->buf0_valid) {
+		return 0;
+	}
+	return filter->buf0[(filter->buf0_head_index + (~pos)) & filter->buf0_size_mask];
+}
+
+// Read the first sample buffer of a filter, which is packed to 12 bits.
+uint16_t filter_buf_read_packed(struct filter *filter, uint16_t pos)
+{
+	if (pos >= filter->buf0_valid) {
+		return 0;
+	}
+	return packed_buf_read(filter, pos);
+}
+
+// Read the first sample buffer of a filter, which is companded to mu-law.
+uint16_t filter_buf_read_ulaw(struct filter *filter, uint16_t pos)
+{
+	if (pos >= filter->buf0_valid) {
+		return 0;
+	}
+	return ulaw_decode(((uint8_t *)filter->buf0)[(filter->buf0_head_index + (~pos)) & filter->buf0_size_mask]);
+}
+
+// Read the second sample buffer of a filter.
+uint16_t filter_buf1_read(struct filter *filter, uint16_t pos)
+{
+	if (pos >= filter->buf1_valid) {
+		return 0;
+	}
+	return filter->buf1[(filter->buf1_head_index + (~pos)) & filter->buf1_size_mask];
+}
+
+// Read the value of a specified sample buffer of a given filter struct, however it
+// is stored.
 uint16_t filter_buf_read(struct filter *filter, uint8_t buf_n, uint16_t pos)
 {
 	if (buf_n == 0) {
-		return filter->buf0[(filter->buf0_head_index + (~pos)) & filter->buf0_size_mask];
+		if (filter->buf0_storage == BUF_STORAGE_PLAIN) {
+			return filter_buf_read_plain(filter, pos);
+		} else if (filter->buf0_storage == BUF_STORAGE_PACKED) {
+			return filter_buf_read_packed(filter, pos);
+		}
+		return filter_buf_read_ulaw(filter, pos);
 	} else if (buf_n == 1) {
-		return filter->buf1[(filter->buf1_head_index + (~pos)) & filter->buf1_size_mask];
+		return filter_buf1_read(filter, pos);
 	}
 	#if DEBUG==1
 	tty_writeln("ERROR: Trying to read a buf_n that isn't 0 or 1.");
@@ -393,6 +943,9 @@ void alloc_init() {
 // Handles output from filter functions. Simple call just to prevent duplicating code
 // in dozens of functions with common behaviour.
 uint16_t filter_output(struct filter *filter, uint16_t v) {
+	if (filter == capture.filter) {
+		capture_sample(v);
+	}
 	if (filter->next) {
 		filter_buf_write(filter->next, filter->next_buf_n, v);
 	}
@@ -1,11 +1,14 @@
 #ifndef _HAPR_ALLOC_H
 #define _HAPR_ALLOC_H
 
+#define FUSED_TABLE_SIZE 4096 // Entries in the table of a fused run of filters, one for each ADC value.
+
 // Struct used to contain an initialised filter.
 struct filter
 {
 	uint16_t filter_id; // Integer ID of filter, used for reference and in UI.
-	void (*filter_function)(struct filter *filter); // Function to use to apply filter.
+	uint16_t filter_type; // Index of filter_function in filter_functions.
+	void (*filter_function)(struct filter *filter); // Function to use to apply filter, a variant of its type's picked by filter_bind().
 	struct filter *next; // Pointer to first next filter struct in graph.
 	uint16_t next_buf_n; // Buffer number of first next filter struct in graph.
 	struct filter *next2; // Pointer to second next filter struct in graph.
@@ -14,18 +17,44 @@ struct filter
 	uint16_t param1; // Second parameter for filter.
 	uint16_t param2; // Third parameter for filter.
 	uint16_t param3; // Fourth parameter for filter.
+	uint16_t param_target[4]; // Values param0..param3 ramp towards (see filter_params_step).
+	uint16_t params_moving; // Bit n set while paramn is still ramping, 0 once all have settled.
+	float control; // Value of a control-rate filter's control, interpolated every sample (see filter_control_step).
+	float control_step; // Added to control every sample.
+	float (*control_function)(struct filter *filter, uint32_t t); // Control of the filter, picked by filter_bind(), NULL if it has none.
+	struct filter *control_next; // Next filter whose control steps in the same slot.
 	uint16_t multi_input; // Does filter have a second buffer? 0/1
 	uint16_t buf0_size; // Length of first sample circular buffer.
 	uint16_t buf0_size_mask;
 	uint16_t buf0_head_index; // Current index in first sample circular buffer.
+	uint16_t buf0_valid; // Samples written to first buffer, up to buf0_size. Older ones read as 0.
+	uint16_t buf0_storage; // How first buffer stores samples, BUF_STORAGE_* (see alloc.c).
 	uint16_t *buf0; // Array of first sample circular buffer.
 	uint16_t buf1_size; // Length of second sample circular buffer.
 	uint16_t buf1_size_mask;
 	uint16_t buf1_head_index; // Current index in second sample circular buffer.
+	uint16_t buf1_valid; // Samples written to second buffer, up to buf1_size. Older ones read as 0.
 	uint16_t *buf1; // Array of second sample circular buffer.
+	uint16_t *fused_table; // Output of the run fused into this filter for each sample, NULL if it isn't the first of one (see filter_fuse).
+	struct filter *fused_last; // Last filter of the fused run, reached through next.
+	struct filter *fused_first; // First filter of the fused run this one is in, NULL if it isn't in one.
+	#if PROFILE==1
+	struct profile profile; // Cycle counts of filter_function (see profile.c).
+	#endif
+};
+
+// Arena usage at some point, see alloc_checkpoint().
+struct alloc_checkpoint
+{
+	uint16_t filters; // Filter structs allocated.
+	uint16_t queues; // Queue structs allocated.
+	uint16_t queue_elements; // Queue element structs allocated.
 };
 
 void alloc_init();
+void alloc_checkpoint(struct alloc_checkpoint *checkpoint);
+void alloc_rollback(struct alloc_checkpoint *checkpoint);
+void free_all();
 struct filter *alloc_filter();
 void free_all_filters();
 struct queue *alloc_queue();
@@ -33,9 +62,12 @@ void free_queue(struct queue *f);
 struct queue_element *alloc_queue_element();
 void free_queue_element(struct queue_element *f);
 void free_all_buf();
-void zero_buf(uint16_t *buf, uint16_t buf_size);
 uint16_t *alloc_buf(uint32_t requested_buf);
 void free_buf(uint16_t *b, uint32_t buf_size);
+uint16_t filter_buf_read_plain(struct filter *filter, uint16_t pos);
+uint16_t filter_buf_read_packed(struct filter *filter, uint16_t pos);
+uint16_t filter_buf_read_ulaw(struct filter *filter, uint16_t pos);
+uint16_t filter_buf1_read(struct filter *filter, uint16_t pos);
 uint16_t filter_buf_read(struct filter *filter, uint8_t buf_n, uint16_t pos);
 void alloc_init();
 uint16_t filter_output(struct filter *filter, uint16_t v);
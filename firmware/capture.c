@@ -0,0 +1,127 @@
+// Capture of the output of any filter in the graph, used by the scope in the GUI to
+// see what a filter does rather than only hearing it. The timer interrupt feeds the
+// ring through capture_sample() and the main loop drains it with capture_read(),
+// neither ever waits for the other.
+
+#ifndef _HAPR_CAPTURE
+#define _HAPR_CAPTURE
+
+#include "lpc_types.h"
+
+#include "alloc.h"
+#include "capture.h"
+
+#define CAPTURE_MASK (CAPTURE_LENGTH - 1)
+
+// Tap the output of a filter. Triggered captures keep the last pretrigger samples
+// before the output crosses level, then CAPTURE_LENGTH - pretrigger more, keeping
+// one sample in every decimation. Returns 1 if there is no such filter or no room
+// for the ring.
+uint16_t capture_start(struct filter *filter, uint8_t trigger, uint16_t level, uint16_t pretrigger, uint16_t decimation)
+{
+	capture_stop();
+
+	if (filter == NULL) {
+		return 1;
+	}
+	capture.ring = buf_pool_alloc(&buf2, buf_order(CAPTURE_LENGTH));
+	if (capture.ring == NULL) {
+		return 1;
+	}
+
+	capture.head = 0;
+	capture.tail = 0;
+	capture.trigger = trigger;
+	capture.level = level;
+	capture.pretrigger = pretrigger < CAPTURE_LENGTH ? pretrigger : CAPTURE_LENGTH - 1;
+	capture.remaining = CAPTURE_LENGTH - capture.pretrigger;
+	capture.decimation = decimation > 0 ? decimation : 1;
+	capture.decimation_count = 0;
+	// neither edge can be seen from the level itself, so the first sample never triggers
+	capture.previous = level;
+	capture.overruns = 0;
+	capture.state = trigger == CAPTURE_FREE ? CAPTURE_RUNNING : CAPTURE_ARMED;
+
+	// the interrupt only looks at the rest once the filter is set
+	capture.filter = filter;
+
+	return 0;
+}
+
+// Stop capturing and give the ring back. The interrupt can't preempt itself, so
+// once the filter is cleared nothing touches the ring any more.
+void capture_stop()
+{
+	capture.filter = NULL;
+	capture.state = CAPTURE_OFF;
+	if (capture.ring != NULL) {
+		free_buf(capture.ring, CAPTURE_LENGTH);
+		capture.ring = NULL;
+	}
+}
+
+// Take one output sample of the tapped filter. Called from the timer interrupt.
+// marked as inline to allow compiler optimizations
+inline void capture_sample(uint16_t v)
+{
+	if (++capture.decimation_count < capture.decimation) {
+		return;
+	}
+	capture.decimation_count = 0;
+
+	if (capture.state == CAPTURE_ARMED) {
+		// only trigger once there is a full pre-trigger history
+		uint8_t triggered = (uint16_t)(capture.head - capture.tail) >= capture.pretrigger &&
+			((capture.trigger == CAPTURE_RISING && capture.previous < capture.level && v >= capture.level) ||
+			(capture.trigger == CAPTURE_FALLING && capture.previous > capture.level && v <= capture.level));
+		capture.previous = v;
+		if (!triggered) {
+			capture.ring[capture.head & CAPTURE_MASK] = v;
+			capture.head++;
+			if ((uint16_t)(capture.head - capture.tail) > capture.pretrigger) {
+				capture.tail++;
+			}
+			return;
+		}
+		// the main loop owns tail from here on
+		capture.state = CAPTURE_RUNNING;
+	}
+
+	if (capture.state == CAPTURE_RUNNING) {
+		if ((uint16_t)(capture.head - capture.tail) >= CAPTURE_LENGTH) {
+			capture.overruns++;
+		} else {
+			capture.ring[capture.head & CAPTURE_MASK] = v;
+			capture.head++;
+		}
+		if (capture.trigger != CAPTURE_FREE && --capture.remaining == 0) {
+			capture.state = CAPTURE_DONE;
+		}
+	}
+}
+
+// Samples which can be read, none until the capture has triggered.
+uint16_t capture_available()
+{
+	if (capture.state < CAPTURE_RUNNING) {
+		return 0;
+	}
+	return capture.head - capture.tail;
+}
+
+// Read up to max captured samples, oldest first. Returns how many were read.
+uint16_t capture_read(uint16_t *samples, uint16_t max)
+{
+	uint16_t i, n = capture_available();
+	if (n > max) {
+		n = max;
+	}
+	for (i = 0; i < n; i++) {
+		samples[i] = capture.ring[(capture.tail + i) & CAPTURE_MASK];
+	}
+	// only publish the space once the samples are copied out
+	capture.tail += n;
+	return n;
+}
+
+#endif
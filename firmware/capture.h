@@ -0,0 +1,47 @@
+#ifndef _HAPR_CAPTURE_H
+#define _HAPR_CAPTURE_H
+
+#define CAPTURE_LENGTH 1024 // Samples in the capture ring and in one triggered capture, a power of two.
+#define CAPTURE_LINE_SAMPLES 8 // Samples sent in each reply to the scope command in the plain protocol.
+
+// Triggers.
+#define CAPTURE_RISING 0 // Starts when the tapped output rises through the level.
+#define CAPTURE_FALLING 1 // Starts when the tapped output falls through the level.
+#define CAPTURE_FREE 2 // Starts straight away and streams until stopped.
+
+// States, only ever moved forward by the timer interrupt once armed.
+#define CAPTURE_OFF 0
+#define CAPTURE_ARMED 1 // Keeping pre-trigger history, waiting for the trigger.
+#define CAPTURE_RUNNING 2 // Triggered, samples can be read with capture_read().
+#define CAPTURE_DONE 3 // All CAPTURE_LENGTH samples taken, those not read yet still can be.
+
+// Capture of the output of one filter. The ring is a single-producer single-consumer
+// queue: the timer interrupt only writes head and the main loop only writes tail,
+// except while armed when nothing is read and the interrupt drops history past the
+// pre-trigger depth itself.
+struct capture
+{
+	struct filter *filter; // Filter whose output is tapped, NULL when off.
+	uint16_t *ring; // CAPTURE_LENGTH samples from the second sample pool (AHB SRAM).
+	volatile uint16_t head; // Samples written, free running.
+	volatile uint16_t tail; // Samples read or dropped, free running.
+	volatile uint8_t state; // CAPTURE_*.
+	uint8_t trigger; // CAPTURE_RISING, CAPTURE_FALLING or CAPTURE_FREE.
+	uint16_t level; // Trigger level, as a sample value.
+	uint16_t pretrigger; // Samples kept from before the trigger.
+	uint16_t remaining; // Samples still to be taken after the trigger.
+	uint16_t decimation; // Only one in this many samples is kept.
+	uint16_t decimation_count;
+	uint16_t previous; // Last sample kept, for edge detection.
+	volatile uint16_t overruns; // Samples dropped while streaming because the ring was full.
+};
+
+struct capture capture;
+
+uint16_t capture_start(struct filter *filter, uint8_t trigger, uint16_t level, uint16_t pretrigger, uint16_t decimation);
+void capture_stop();
+inline void capture_sample(uint16_t v);
+uint16_t capture_available();
+uint16_t capture_read(uint16_t *samples, uint16_t max);
+
+#endif
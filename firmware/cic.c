@@ -0,0 +1,42 @@
+// Decimation of oversampled ADC conversions (see adc.c). Depends on nothing but
+// stdint.h, so it can be built and fed synthetic input on the host as well.
+
+#ifndef _HAPR_CIC
+#define _HAPR_CIC
+
+#include "cic.h"
+
+void cic_reset(struct cic *cic)
+{
+	uint16_t i;
+	for (i = 0; i < CIC_ORDER; i++) {
+		cic->integrator[i] = 0;
+		cic->comb[i] = 0;
+	}
+}
+
+// Feed one input, at the oversampled rate.
+void cic_push(struct cic *cic, uint16_t x)
+{
+	uint16_t i;
+	uint32_t v = x;
+	for (i = 0; i < CIC_ORDER; i++) {
+		cic->integrator[i] += v;
+		v = cic->integrator[i];
+	}
+}
+
+// Take an output, once every CIC_DECIMATION inputs. Its range is that of the inputs.
+uint16_t cic_pull(struct cic *cic)
+{
+	uint16_t i;
+	uint32_t v = cic->integrator[CIC_ORDER - 1];
+	for (i = 0; i < CIC_ORDER; i++) {
+		uint32_t previous = cic->comb[i];
+		cic->comb[i] = v;
+		v -= previous;
+	}
+	return (v * CIC_SCALE) >> 16;
+}
+
+#endif
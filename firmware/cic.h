@@ -0,0 +1,23 @@
+#ifndef _HAPR_CIC_H
+#define _HAPR_CIC_H
+
+#include "stdint.h"
+
+#define CIC_ORDER 3 // Integrator and comb stages.
+#define CIC_DECIMATION 5 // Inputs for each output.
+#define CIC_SCALE 524 // 65536 / CIC_DECIMATION^CIC_ORDER, undoes the gain of the stages.
+
+// Cascaded integrator-comb decimator: a moving sum of CIC_DECIMATION inputs taken
+// CIC_ORDER times over, which only needs additions. The sums wrap around freely,
+// the difference the combs take still comes out right.
+struct cic
+{
+	uint32_t integrator[CIC_ORDER];
+	uint32_t comb[CIC_ORDER]; // Last input of each comb stage.
+};
+
+void cic_reset(struct cic *cic);
+void cic_push(struct cic *cic, uint16_t x);
+uint16_t cic_pull(struct cic *cic);
+
+#endif
@@ -17,9 +17,10 @@
 
 #include "dac.h"
 
+// Output the current sample, put in the block the DMA plays next.
 // marked as inline to allow compiler optimizations
 inline void dac_set_value(uint16_t value) {
-	DAC_UpdateValue(LPC_DAC, value >> 2);
+	*dac_sample = DAC_WORD(value);
 }
 
 void dac_init()
@@ -34,6 +35,8 @@ void dac_init()
   PINSEL_ConfigPin(&PinCfg);
 
   DAC_Init(LPC_DAC);
+
+  dac_sample = &dac_spare;
 }
 
 #endif
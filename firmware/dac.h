@@ -1,6 +1,13 @@
 #ifndef _HAPR_DAC_H
 #define _HAPR_DAC_H
 
+// DACR holding a 12-bit sample, which the DAC takes the top 10 bits of.
+#define DAC_WORD(value) (((uint32_t)(value) >> 2) << 6)
+
+uint32_t *dac_block; // Two halves of AUDIO_BLOCK DACR words, played in turn by the DMA (see timer.c).
+uint32_t *dac_sample; // Word of dac_block the current sample goes to.
+uint32_t dac_spare; // Where samples go while no block is being filled.
+
 inline void dac_set_value(uint16_t value);
 void dac_init();
 
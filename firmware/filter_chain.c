@@ -70,7 +70,11 @@
 #include "stdio.h"
 #include "stdlib.h"
 
+#include "LPC17xx.h"
+
+#include "profile.h"
 #include "alloc.h"
+#include "capture.h"
 #include "dac.h"
 #include "adc.c"
 #include "queue.h"
@@ -85,6 +89,13 @@
 #define NUMBER_OF_STEPS 100 // maximum value allowed for the parameters
 #define ADC_STEP VALUE_RANGE/NUMBER_OF_STEPS // a step that is used to scale parameters to a certain ADC value
 
+// Trace line of a filter function which is made by a macro, where #if can't go.
+#if DEBUG==1 && TRACE==1
+#define FILTER_TRACE(name) tty_writeln(name)
+#else
+#define FILTER_TRACE(name)
+#endif
+
 // input from ADC
 void input_function(struct filter *filter)
 {
@@ -96,6 +107,17 @@ void input_function(struct filter *filter)
 	filter_output(filter, v);
 }
 
+// input from a single ADC channel, taken from the frame all inputs share (see adc_sample)
+// param0: 0 or 1 - one of the guitar channels, 2 - microphone, for a sidechain or reference
+void channel_function(struct filter *filter)
+{
+	#if DEBUG==1 && TRACE==1
+	tty_writeln("channel_function");
+	#endif
+	// kept to a channel by filter_bind()
+	filter_output(filter, adc_frame[filter->param0]);
+}
+
 // output to DAC
 void output_function(struct filter *filter)
 {
@@ -103,13 +125,18 @@ void output_function(struct filter *filter)
 	tty_writeln("output_function");
 	#endif
 
-	uint16_t v = filter_buf_read(filter, 0, 0);
+	uint16_t v = filter_buf_read_plain(filter, 0);
 
 	#if DEBUG==1 && TRACE==1
 	tty_write("Output = ");
 	tty_writeln_int(v);
 	#endif
 
+	// the output filter has no outputs of its own, so it is tapped here
+	if (filter == capture.filter) {
+		capture_sample(v);
+	}
+
 	dac_set_value(v);
 }
 
@@ -120,7 +147,7 @@ void passthrough_function(struct filter *filter)
 	tty_writeln("passthrough_function");
 	#endif
 
-	uint16_t v = filter_buf_read(filter, 0, 0);
+	uint16_t v = filter_buf_read_plain(filter, 0);
 
 	filter_output(filter, v);
 }
@@ -136,36 +163,48 @@ void zero_function(struct filter *filter)
 	filter_output(filter, v);
 }
 
+// Filters which map each sample to another on its own have their map apart from
+// the filter function, so a run of them can be worked out into one table (see
+// filter_fuse).
+
 // limit output amplitude
 // takes param0: a step value that gets multiplied with ADC_STEP to compute the maximum value
-void max_function(struct filter *filter)
+uint16_t max_point(struct filter *filter, uint16_t v)
 {
-	#if DEBUG==1 && TRACE==1
-	tty_writeln("max_function");
-	#endif
 	uint16_t max = filter->param0*ADC_STEP;
-	uint16_t v = filter_buf_read(filter, 0, 0);
 
 	if (v > max)
 		v = max;
 
-	filter_output(filter, v);
+	return v;
 }
 
-// limit output amplitude
-// takes param0: a step value that gets multiplied with ADC_STEP to compute the maximum value
-void min_function(struct filter *filter)
+void max_function(struct filter *filter)
 {
 	#if DEBUG==1 && TRACE==1
-	tty_writeln("min_function");
+	tty_writeln("max_function");
 	#endif
+	filter_output(filter, max_point(filter, filter_buf_read_plain(filter, 0)));
+}
+
+// limit output amplitude
+// takes param0: a step value that gets multiplied with ADC_STEP to compute the maximum value
+uint16_t min_point(struct filter *filter, uint16_t v)
+{
 	uint16_t min = filter->param0*ADC_STEP;
-	uint16_t v = filter_buf_read(filter, 0, 0);
 
 	if (v < min)
 		v = min;
 
-	filter_output(filter, v);
+	return v;
+}
+
+void min_function(struct filter *filter)
+{
+	#if DEBUG==1 && TRACE==1
+	tty_writeln("min_function");
+	#endif
+	filter_output(filter, min_point(filter, filter_buf_read_plain(filter, 0)));
 }
 
 // creates and outputs a sine wave, takes no input
@@ -190,105 +229,126 @@ void sine_function(struct filter *filter)
 	filter_output(filter, v);
 }
 
+// waveforms of the low frequency oscillators at sample t, between 0 and 1; all but
+// the sine count their period, freq or twice it, in samples
+#define LFO_SINE(freq, phase, t) ((sin(TWO_PI * (freq) * ((float)(t) / (float)frequency) + (phase))+1) * 0.5)
+#define LFO_TRIANGLE(freq, phase, t) (abs((int32_t)((t) % ((freq)*2)) - (freq)) / (float)(freq))
+#define LFO_SQUARE(freq, phase, t) (((t) % (freq)) < ((freq)/2) ? 0 : 1)
+#define LFO_UPWARD_SAW(freq, phase, t) (((t) % (freq)) / (float)(freq))
+#define LFO_DOWNWARD_SAW(freq, phase, t) (((freq) - ((t) % (freq))) / (float)(freq))
+// phase shift of a parameter, 0 to NUMBER_OF_STEPS for 0 to TWO_PI
+#define LFO_PHASE(param) ((uint16_t)((((float)(param))*TWO_PI)/NUMBER_OF_STEPS))
+
+// Control of a filter for the current sample, moving it on towards the value
+// filter_control_step() last computed.
+float filter_control_next(struct filter *filter)
+{
+	float x = filter->control;
+	filter->control += filter->control_step;
+	return x;
+}
+
+// tremolo LFO, a sine; the other LFO types run every sample (see TREMOLO_FUNCTION)
+float tremolo_control(struct filter *filter, uint32_t t)
+{
+	return LFO_SINE(filter->param1, LFO_PHASE(filter->param2), t);
+}
+
 // tremolo filter
 // param0: depth, percentage: 100% - amplitude goes between 0 and 1; 30% - amplitude goes between 0.7 and 1
 // param1: 0-NUMBER_OF_STEPS, frequency
 // param2: 0 to NUMBER_OF_STEPS, phase shift, 0 means 0 phase, NUMBER_OF_STEPS means TWO_PI phase difference
 // param3: 0-NUMBER_OF_STEPS, type, 1- triangle, 2 - square, 3 - upward saw, 4 - downward saw, otherwise - sine
-void tremolo_function(struct filter *filter)
-{
-	#if DEBUG==1 && TRACE==1
-	tty_writeln("tremolo_function");
-	#endif
-
-	uint16_t depth = filter->param0;
-	uint16_t freq = filter->param1;
-	uint16_t phase = (((float)filter->param2)*TWO_PI)/NUMBER_OF_STEPS;
-	uint16_t type  = filter->param3;
-
-	if(depth > 100){
-		filter->param0 = depth = 100;
-	}
-
-	int16_t v = filter_buf_read(filter, 0, 0);
-
-	float d = (depth / 100.0);
+// Made once for each LFO type (see filter_bind), the plain one is the sine.
+#define TREMOLO_FUNCTION(name, lfo) \
+void name(struct filter *filter) \
+{ \
+	FILTER_TRACE(#name); \
+ \
+	uint16_t depth = filter->param0; /* at most 100, see filter_bind */ \
+ \
+	int16_t v = filter_buf_read_plain(filter, 0); \
+ \
+	float d = (depth / 100.0); \
+ \
+	float x = lfo; \
+ \
+	float inter = x * d; \
+ \
+	v-=VALUE_ZERO; \
+	v = (v * inter); \
+	v+=VALUE_ZERO; \
+ \
+	filter_output(filter, v); \
+}
 
-	float x;
-	if(type == 1){
-		//tri
-		x = abs((cycle % (freq*2)) - freq) / (float)freq;
-	}else if(type == 2){
-		//sqr
-		x = (cycle % freq) < (freq/2) ? 0 : 1;
-	}else if(type == 3){
-		//upward saw
-		x = (cycle % freq) / (float)freq;
-	}else if(type == 4){
-		//downward saw
-		x = (freq - (cycle % freq)) / (float)freq;
-	}else{
-		//sin
-		float t = (float)cycle / (float)frequency;
-		x = (sin(TWO_PI * freq * t + phase)+1) * 0.5;
-	}
-
-	float inter = x * d;
-
-	v-=VALUE_ZERO;
-	v = (v * inter);
-	v+=VALUE_ZERO;
+// the sine, param1 and param2, runs at control rate (see tremolo_control)
+TREMOLO_FUNCTION(tremolo_function, filter_control_next(filter))
+TREMOLO_FUNCTION(tremolo_triangle_function, LFO_TRIANGLE(filter->param1, 0, cycle))
+TREMOLO_FUNCTION(tremolo_square_function, LFO_SQUARE(filter->param1, 0, cycle))
+TREMOLO_FUNCTION(tremolo_upward_saw_function, LFO_UPWARD_SAW(filter->param1, 0, cycle))
+TREMOLO_FUNCTION(tremolo_downward_saw_function, LFO_DOWNWARD_SAW(filter->param1, 0, cycle))
 
-	filter_output(filter, v);
+// reverb modulation of the delay, between 0.5 and 1
+float reverb_control(struct filter *filter, uint32_t t)
+{
+	return ((sin(TWO_PI * filter->param2 * ((float)t / (float)frequency))+1) * 0.25) + 0.5;
 }
 
+// Delay and reverb read their buffer through the reader of the storage it uses,
+// they are made once for each (see filter_bind). The plain ones are the
+// reverb_function and delay_function of filter_functions.
+
 // reverb filter
 // param0: 0-NUMBER_OF_STEPS, decay 0- no delay, NUMBER_OF_STEPS - maximum delay
 // param1: 0-100, decay
 // param2: 0-NUMBER_OF_STEPS, frequency
-void reverb_function(struct filter *filter) //@TODO test
-{
-	#if DEBUG==1 && TRACE==1
-	tty_writeln("delay_function");
-	#endif
-	uint16_t delay = (((float)filter->param0)*DELAY_BUFFER_SIZE)/NUMBER_OF_STEPS;
-	uint16_t decay = filter->param1;
-	uint16_t freq = filter->param2;
-
-	if (decay > 100){
-		filter->param1 = decay = 100;
-	}
-
-	float t = (float)cycle / (float)frequency;
-	float x = ((sin(TWO_PI * freq * t)+1) * 0.25) + 0.5;
-
-	delay = delay * x;
-
-	uint16_t v = filter_buf_read(filter, 0, 1);
-	int16_t delay_v = (int16_t)filter_buf_read(filter, 0, delay);
-
-	delay_v -= VALUE_ZERO;
-	delay_v *= decay;
-	delay_v /= 100;
-
-	v = v + delay_v;
-
-	filter_output(filter, v);
+// param3: 0 plain, 1 packed to 12 bits for a third more delay, 2 mu-law for twice the delay
+#define REVERB_FUNCTION(name, read) \
+void name(struct filter *filter) \
+{ \
+	FILTER_TRACE(#name); \
+	uint16_t delay = (((float)filter->param0)*(filter->buf0_size-1))/NUMBER_OF_STEPS; \
+	uint16_t decay = filter->param1; /* at most 100, see filter_bind */ \
+ \
+	/* modulated by param2 at control rate (see reverb_control) */ \
+	float x = filter_control_next(filter); \
+ \
+	delay = delay * x; \
+ \
+	uint16_t v = read(filter, 1); \
+	int16_t delay_v = (int16_t)read(filter, delay); \
+ \
+	delay_v -= VALUE_ZERO; \
+	delay_v *= decay; \
+	delay_v /= 100; \
+ \
+	v = v + delay_v; \
+ \
+	filter_output(filter, v); \
 }
 
+REVERB_FUNCTION(reverb_function, filter_buf_read_plain)
+REVERB_FUNCTION(reverb_packed_function, filter_buf_read_packed)
+REVERB_FUNCTION(reverb_ulaw_function, filter_buf_read_ulaw)
+
 // delay function
 // param0: 0-NUMBER_OF_STEPS, decay 0- no delay, NUMBER_OF_STEPS - maximum delay
-void delay_function(struct filter *filter)
-{
-	#if DEBUG==1 && TRACE==1
-	tty_writeln("delay_function");
-	#endif
-	uint16_t delay = (((float)filter->param0)*DELAY_BUFFER_SIZE)/NUMBER_OF_STEPS;
-	uint16_t v = filter_buf_read(filter, 0, delay);
-
-	filter_output(filter, v);
+// param3: 0 plain, 1 packed to 12 bits for a third more delay, 2 mu-law for twice the delay
+#define DELAY_FUNCTION(name, read) \
+void name(struct filter *filter) \
+{ \
+	FILTER_TRACE(#name); \
+	uint16_t delay = (((float)filter->param0)*(filter->buf0_size-1))/NUMBER_OF_STEPS; \
+	uint16_t v = read(filter, delay); \
+ \
+	filter_output(filter, v); \
 }
 
+DELAY_FUNCTION(delay_function, filter_buf_read_plain)
+DELAY_FUNCTION(delay_packed_function, filter_buf_read_packed)
+DELAY_FUNCTION(delay_ulaw_function, filter_buf_read_ulaw)
+
 // mix function, it takes two input buffer and multiplexes it using a ratio
 // param0: 0-NUMBER_OF_STEPS, mix ratio, 0 - only buffer 1; NUMBER_OF_STEPS/2 - half and half; NUMBER_OF_STEPS - only buffer 2
 void mix_function(struct filter *filter) //@TODO test
@@ -298,73 +358,78 @@ void mix_function(struct filter *filter) //@TODO test
 	#endif
 	uint16_t p0 = filter->param0;
 
-	uint16_t v1 = filter_buf_read(filter, 0, 0);
-	uint16_t v2 = filter_buf_read(filter, 1, 0);
+	uint16_t v1 = filter_buf_read_plain(filter, 0);
+	uint16_t v2 = filter_buf1_read(filter, 0);
 
 	v1 = (p0*v1)/NUMBER_OF_STEPS + ((NUMBER_OF_STEPS-p0)*v2)/NUMBER_OF_STEPS;
 
 	filter_output(filter, v1);
 }
 
-// flange filter
-// param0: 0-NUMBER_OF_STEPS, frequency
-// param1: 0 to NUMBER_OF_STEPS, phase shift, 0 means 0 phase, NUMBER_OF_STEPS means TWO_PI phase difference
-// param2: 0 to NUMBER_OF_STEPS, max delay, 0 - no delay, NUMBER_OF_STEPS means FLANGE_BUFFER_SIZE maxdelay
-// param3: 0-NUMBER_OF_STEPS, type, 1- triangle, 2 - square, 3 - upward saw, 4 - downward saw, otherwise - sine
-void flange_function(struct filter *filter)
+// mix at a ratio of NUMBER_OF_STEPS, which is only the first buffer (see filter_bind)
+void mix_buf0_function(struct filter *filter)
 {
 	#if DEBUG==1 && TRACE==1
-	tty_writeln("flange_function");
+	tty_writeln("mix_buf0_function");
 	#endif
+	filter_output(filter, filter_buf_read_plain(filter, 0));
+}
 
-	uint16_t freq = filter->param0;
-	uint16_t phase = (((float)filter->param1)*TWO_PI)/NUMBER_OF_STEPS;
-	uint16_t maxdelay = (((float)filter->param2)*FLANGE_BUFFER_SIZE)/NUMBER_OF_STEPS;
-	uint16_t type  = filter->param3;
+// mix at a ratio of 0, which is only the second buffer (see filter_bind)
+void mix_buf1_function(struct filter *filter)
+{
+	#if DEBUG==1 && TRACE==1
+	tty_writeln("mix_buf1_function");
+	#endif
+	filter_output(filter, filter_buf1_read(filter, 0));
+}
 
-	float x;
-	if(type == 1){
-		//tri
-		x = abs((cycle % (freq*2)) - freq) / (float)freq;
-	}else if(type == 2){
-		//sqr
-		x = (cycle % freq) < (freq/2) ? 0 : 1;
-	}else if(type == 3){
-		//upward saw
-		x = (cycle % freq) / (float)freq;
-	}else if(type == 4){
-		//downward saw
-		x = (freq - (cycle % freq)) / (float)freq;
-	}else{
-		//sin
-		float t = (float)cycle / (float)frequency;
-		x = (sin(TWO_PI * freq * t + phase)+1) * 0.5;
-	}
-
-	uint16_t delay = x * maxdelay;
-
-	uint16_t v1 = filter_buf_read(filter, 0, 0);
-	uint16_t v2 = filter_buf_read(filter, 0, delay);
-
-	v1 = (v1 + v2) / 2;
-	filter_output(filter, v1);
+// flange LFO, a sine; the other LFO types run every sample (see FLANGE_FUNCTION)
+float flange_control(struct filter *filter, uint32_t t)
+{
+	return LFO_SINE(filter->param0, LFO_PHASE(filter->param1), t);
+}
+
+// flange filter
+// param0: 0-NUMBER_OF_STEPS, frequency
+// param1: 0 to NUMBER_OF_STEPS, phase shift, 0 means 0 phase, NUMBER_OF_STEPS means TWO_PI phase difference
+// param2: 0 to NUMBER_OF_STEPS, max delay, 0 - no delay, NUMBER_OF_STEPS means FLANGE_BUFFER_SIZE maxdelay
+// param3: 0-NUMBER_OF_STEPS, type, 1- triangle, 2 - square, 3 - upward saw, 4 - downward saw, otherwise - sine
+// Made once for each LFO type (see filter_bind), the plain one is the sine.
+#define FLANGE_FUNCTION(name, lfo) \
+void name(struct filter *filter) \
+{ \
+	FILTER_TRACE(#name); \
+ \
+	uint16_t maxdelay = (((float)filter->param2)*FLANGE_BUFFER_SIZE)/NUMBER_OF_STEPS; \
+ \
+	float x = lfo; \
+ \
+	uint16_t delay = x * maxdelay; \
+ \
+	uint16_t v1 = filter_buf_read_plain(filter, 0); \
+	uint16_t v2 = filter_buf_read_plain(filter, delay); \
+ \
+	v1 = (v1 + v2) / 2; \
+	filter_output(filter, v1); \
 }
 
+// the sine, param0 and param1, runs at control rate (see flange_control)
+FLANGE_FUNCTION(flange_function, filter_control_next(filter))
+FLANGE_FUNCTION(flange_triangle_function, LFO_TRIANGLE(filter->param0, 0, cycle))
+FLANGE_FUNCTION(flange_square_function, LFO_SQUARE(filter->param0, 0, cycle))
+FLANGE_FUNCTION(flange_upward_saw_function, LFO_UPWARD_SAW(filter->param0, 0, cycle))
+FLANGE_FUNCTION(flange_downward_saw_function, LFO_DOWNWARD_SAW(filter->param0, 0, cycle))
+
 // upward compressor filter
 // param0: 0-NUMBER_OF_STEPS, threshold, 0 - VALUE_ZERO threshold, NUMBER_OF_STEPS - VALUE_RANGE threshold
 // param1:  0-NUMBER_OF_STEPS, controls the steepness of the compression
-void upward_compressor_function(struct filter *filter) { //@TODO test
-	#if DEBUG==1 && TRACE==1
-	tty_writeln("upward_compressor_function");
-	#endif
-
+uint16_t upward_compressor_point(struct filter *filter, uint16_t v) { //@TODO test
 	uint16_t threshold = (((float)filter->param0)*(VALUE_RANGE-VALUE_ZERO))/NUMBER_OF_STEPS;
 	uint16_t ratio = filter->param1;
 
 	threshold = VALUE_ZERO + threshold;
 
-	uint16_t v = filter_buf_read(filter, 0, 0);
-
 	if(ratio == 0){
 		ratio = 1;
 	}
@@ -374,24 +439,27 @@ void upward_compressor_function(struct filter *filter) { //@TODO test
 		v = threshold + (diff / ratio);
 	}
 
-	filter_output(filter, v);
+	return v;
+}
+
+void upward_compressor_function(struct filter *filter)
+{
+	#if DEBUG==1 && TRACE==1
+	tty_writeln("upward_compressor_function");
+	#endif
+	filter_output(filter, upward_compressor_point(filter, filter_buf_read_plain(filter, 0)));
 }
 
 // upward compressor filter
 // param0: 0-NUMBER_OF_STEPS, threshold, 0 - VALUE_ZERO threshold, NUMBER_OF_STEPS - VALUE_RANGE threshold
 // param1:  0-NUMBER_OF_STEPS, controls the steepness of the compression
-void downward_compressor_function(struct filter *filter) //@TODO test
+uint16_t downward_compressor_point(struct filter *filter, uint16_t v) //@TODO test
 {
-	#if DEBUG==1 && TRACE==1
-	tty_writeln("downward_compressor_function");
-	#endif
 	uint16_t threshold = (((float)filter->param0)*(VALUE_RANGE-VALUE_ZERO))/NUMBER_OF_STEPS;
 	uint16_t ratio = filter->param1; // ratio of ratio:1
 
 	threshold = VALUE_ZERO - threshold;
 
-	uint16_t v = filter_buf_read(filter, 0, 0);
-
 	if(ratio == 0){
 		ratio = 1;
 	}
@@ -401,39 +469,45 @@ void downward_compressor_function(struct filter *filter) //@TODO test
 		v = threshold - (diff / ratio);
 	}
 
-	filter_output(filter, v);
+	return v;
 }
 
-// n bits filter
-// param0: 0-12, quantization level
-void n_bits_function(struct filter *filter) //@TODO Improve
+void downward_compressor_function(struct filter *filter)
 {
 	#if DEBUG==1 && TRACE==1
-	tty_writeln("n_bits_function");
+	tty_writeln("downward_compressor_function");
 	#endif
-	uint16_t n = filter->param0;
+	filter_output(filter, downward_compressor_point(filter, filter_buf_read_plain(filter, 0)));
+}
 
-	uint16_t v = filter_buf_read(filter, 0, 0);
+// n bits filter
+// param0: 0-12, quantization level
+uint16_t n_bits_point(struct filter *filter, uint16_t v) //@TODO Improve
+{
+	uint16_t n = filter->param0;
 
 	if(n > 12){
 		n = 12;
 	}
 	v = (v >> (12-n)) << (12-n);
 
-	filter_output(filter, v);
+	return v;
 }
 
-// distortion filter
-// param0: 0 - NUMBER_OF_STEPS, distortion level, 0 - no distortion, NUMBER_OF_STEPS - maximum distortion
-void distortion_function(struct filter *filter)
+void n_bits_function(struct filter *filter)
 {
 	#if DEBUG==1 && TRACE==1
-	tty_writeln("distortion_function");
+	tty_writeln("n_bits_function");
 	#endif
+	filter_output(filter, n_bits_point(filter, filter_buf_read_plain(filter, 0)));
+}
 
+// distortion filter
+// param0: 0 - NUMBER_OF_STEPS, distortion level, 0 - no distortion, NUMBER_OF_STEPS - maximum distortion
+uint16_t distortion_point(struct filter *filter, uint16_t v)
+{
 	uint16_t distortion = (((float)filter->param0)*(VALUE_RANGE-VALUE_ZERO))/NUMBER_OF_STEPS;
 
-	uint16_t v = filter_buf_read(filter, 0, 0);
 	if(v > VALUE_ZERO + distortion){
 		v = VALUE_ZERO + distortion;
 	}
@@ -441,7 +515,15 @@ void distortion_function(struct filter *filter)
 		v = VALUE_ZERO - distortion;
 	}
 
-	filter_output(filter, v);
+	return v;
+}
+
+void distortion_function(struct filter *filter)
+{
+	#if DEBUG==1 && TRACE==1
+	tty_writeln("distortion_function");
+	#endif
+	filter_output(filter, distortion_point(filter, filter_buf_read_plain(filter, 0)));
 }
 
 // triangle generator function, does not take any input
@@ -497,9 +579,9 @@ void aec_lowpass_function(struct filter *filter) //@TODO
 	tty_writeln("aec_lowpass_function");
 	#endif
 
-	float x0 = filter_buf_read(filter, 0, 0) - VALUE_ZERO;
-	float x1 = filter_buf_read(filter, 0, 1) - VALUE_ZERO;
-	float x2 = filter_buf_read(filter, 0, 2) - VALUE_ZERO;
+	float x0 = filter_buf_read_plain(filter, 0) - VALUE_ZERO;
+	float x1 = filter_buf_read_plain(filter, 1) - VALUE_ZERO;
+	float x2 = filter_buf_read_plain(filter, 2) - VALUE_ZERO;
 	float y1 = filter_buf_read(filter->next, 0, 1) - VALUE_ZERO;
 	float y2 = filter_buf_read(filter->next, 0, 2) - VALUE_ZERO;
 
@@ -544,9 +626,9 @@ void aec_highpass_function(struct filter *filter) //@TODO
 	tty_writeln("aec_highpass_function");
 	#endif
 
-	float x0 = filter_buf_read(filter, 0, 0);
-	float x1 = filter_buf_read(filter, 0, 1);
-	float x2 = filter_buf_read(filter, 0, 2);
+	float x0 = filter_buf_read_plain(filter, 0);
+	float x1 = filter_buf_read_plain(filter, 1);
+	float x2 = filter_buf_read_plain(filter, 2);
 	float y1 = filter_buf_read(filter->next, 0, 1);
 	float y2 = filter_buf_read(filter->next, 0, 2);
 
@@ -590,9 +672,9 @@ void aec_allpass_function(struct filter *filter) //@TODO
 	tty_writeln("aec_lowpass_function");
 	#endif
 
-	float x0 = filter_buf_read(filter, 0, 0);
-	float x1 = filter_buf_read(filter, 0, 1);
-	float x2 = filter_buf_read(filter, 0, 2);
+	float x0 = filter_buf_read_plain(filter, 0);
+	float x1 = filter_buf_read_plain(filter, 1);
+	float x2 = filter_buf_read_plain(filter, 2);
 	float y1 = filter_buf_read(filter->next, 0, 1);
 	float y2 = filter_buf_read(filter->next, 0, 2);
 
@@ -669,9 +751,9 @@ void phaser_function(struct filter *filter)
 	tty_writeln("phaser_function");
 	#endif
 
-	float x0 = filter_buf_read(filter, 0, 0);
-	float x1 = filter_buf_read(filter, 0, 1);
-	float x2 = filter_buf_read(filter, 0, 1);
+	float x0 = filter_buf_read_plain(filter, 0);
+	float x1 = filter_buf_read_plain(filter, 1);
+	float x2 = filter_buf_read_plain(filter, 1);
 	float y1 = filter_buf_read(filter->next, 0, 1);
 	float y2 = filter_buf_read(filter->next, 0, 1);
 
@@ -696,12 +778,12 @@ void noise_cancellation_function(struct filter *filter)
 
 	uint16_t avg = 0;
 
-	uint16_t v = filter_buf_read(filter, 0, 0);
+	uint16_t v = filter_buf_read_plain(filter, 0);
 	int i;
 	uint16_t diff;
 
 	for(i =1; i < samples+1; i++){
-		avg += filter_buf_read(filter,0,i);
+		avg += filter_buf_read_plain(filter, i);
 	}
 	avg /= samples;
 
@@ -713,6 +795,32 @@ void noise_cancellation_function(struct filter *filter)
 	filter_output(filter, v);
 }
 
+// Apply the maps of a run of filters fused into a table (see filter_fuse) to a
+// sample, one after the other.
+uint16_t filter_fused_apply(struct filter *filter, uint16_t v)
+{
+	struct filter *member;
+	for (member = filter; member != NULL; member = filter_fused_next(filter, member)) {
+		v = filter_point_functions[member->filter_type](member, v);
+	}
+	return v;
+}
+
+// A run of filters fused into one table, which stands in for all of them: one
+// lookup per sample, then out to where the last of the run writes. Samples past
+// the end of the table, which no ADC gives, are worked out filter by filter.
+void fused_function(struct filter *filter)
+{
+	#if DEBUG==1 && TRACE==1
+	tty_writeln("fused_function");
+	#endif
+	uint16_t v = filter_buf_read_plain(filter, 0);
+
+	v = v < FUSED_TABLE_SIZE ? filter->fused_table[v] : filter_fused_apply(filter, v);
+
+	filter_output(filter->fused_last, v);
+}
+
 // Lookup filter_id in an array indexed by i, the indexes in filters_buf (see filter_init).
 uint16_t filter_id_to_i(uint16_t *filter_ids, uint16_t filters_count, uint16_t uid) {
 	uint16_t i;
@@ -724,8 +832,71 @@ uint16_t filter_id_to_i(uint16_t *filter_ids, uint16_t filters_count, uint16_t u
 	return 0;
 }
 
+// Pick the variant of a filter's function and control made for how the filter is
+// set up, so what that is isn't tested every sample, and keep the parameters
+// the variants rely on in range. Called when the filter is built and whenever one
+// of its parameters changes.
+void filter_bind(struct filter *filter)
+{
+	void (*function)(struct filter *filter) = filter_functions[filter->filter_type];
+	float (*control)(struct filter *filter, uint32_t t) = filter_control_functions[filter->filter_type];
+
+	if (function == tremolo_function && filter->param0 > 100) {
+		filter->param0 = filter->param_target[0] = 100;
+	} else if (function == reverb_function && filter->param1 > 100) {
+		filter->param1 = filter->param_target[1] = 100;
+	} else if (function == channel_function && filter->param0 >= ADC_CHANNELS) {
+		filter->param0 = filter->param_target[0] = ADC_CHANNELS - 1;
+	}
+
+	if (filter->fused_table != NULL) {
+		function = fused_function;
+	} else if (function == delay_function) {
+		function = delay_functions[filter->buf0_storage];
+	} else if (function == reverb_function) {
+		function = reverb_functions[filter->buf0_storage];
+	} else if (function == mix_function && filter->param0 == NUMBER_OF_STEPS) {
+		function = mix_buf0_function;
+	} else if (function == mix_function && filter->param0 == 0) {
+		function = mix_buf1_function;
+	} else if (function == tremolo_function) {
+		function = tremolo_functions[filter->param3 < LFO_TYPES ? filter->param3 : 0];
+	} else if (function == flange_function) {
+		function = flange_functions[filter->param3 < LFO_TYPES ? filter->param3 : 0];
+	}
+
+	// only the sine LFO steps at control rate, the others are worked out every sample
+	if ((control == tremolo_control || control == flange_control) && filter->param3 != 0 && filter->param3 < LFO_TYPES) {
+		control = NULL;
+	}
+
+	filter->filter_function = function;
+	filter->control_function = control;
+}
+
+// Whether filter_bind() picks a variant by this value of a parameter, or clamps it,
+// so a ramp onto or off the value has to bind the filter again. Keep it in step
+// with filter_bind(), only ramping parameters (see filter_function_smoothing) need it.
+uint8_t filter_binds_on(struct filter *filter, uint16_t index, uint16_t value)
+{
+	void (*function)(struct filter *filter) = filter_functions[filter->filter_type];
+
+	if (function == mix_function) {
+		return index == 0 && (value == 0 || value == NUMBER_OF_STEPS);
+	} else if (function == tremolo_function) {
+		return (index == 0 && value > 100) || index == 3;
+	} else if (function == reverb_function) {
+		return index == 1 && value > 100;
+	} else if (function == channel_function) {
+		return index == 0 && value >= ADC_CHANNELS;
+	} else if (function == flange_function) {
+		return index == 3;
+	}
+	return 0;
+}
+
 // Setup a new filter struct. Allocate one and then set simple parameters from
-// specification array.
+// specification array. Returns NULL when out of memory.
 struct filter *new_filter(uint16_t *filter_buf)
 {
 	// Extract values from specification array.
@@ -743,33 +914,54 @@ struct filter *new_filter(uint16_t *filter_buf)
 
 	// Allocate filter struct (see alloc.c).
 	struct filter *filter = alloc_filter();
+	if (filter == NULL) {
+		return NULL;
+	}
 
 	// Set filter properties.
 	filter->filter_id = filter_id;
+	filter->filter_type = filter_functions_index;
 	filter->filter_function = filter_function;
+	filter->fused_table = NULL;
+	filter->fused_last = NULL;
+	filter->fused_first = NULL;
 
-	// Allocate sample buffers (see alloc.c) and zero contents.
+	// Allocate sample buffers (see alloc.c). Each one is stored in the filter
+	// straight away so a rollback of the build frees it. They aren't zeroed, reads
+	// of samples that haven't been written yet return 0 (see filter_buf_read).
 	uint16_t buf_size = filter_function_sizes[filter_functions_index] << multi_input;
-	uint16_t *new_buf0 = alloc_buf(buf_size);
-	zero_buf(new_buf0, buf_size);
-	uint16_t *new_buf1;
-	// If filter has two buffers, allocate and zero the second.
-	if (multi_input) {
-		new_buf1 = alloc_buf(buf_size);
-		zero_buf(new_buf1, buf_size);
-	}
-
-	// Set filter buffer metadata.
 	filter->multi_input = multi_input;
 	filter->buf0_size = buf_size;
 	filter->buf0_size_mask = buf_size - 1;
 	filter->buf0_head_index = 0;
-	filter->buf0 = new_buf0;
+	filter->buf0_valid = 0;
+	filter->buf0_storage = BUF_STORAGE_PLAIN;
+	filter->buf0 = alloc_buf(buf_size);
+	if (filter->buf0 == NULL) {
+		return NULL;
+	}
+	// Delay lines can ask for compact storage (param3) to hold more samples in the
+	// same memory: a third more packed to 12 bits, twice as many companded to 8.
+	if (filter_function == delay_function || filter_function == reverb_function) {
+		if (param3 == BUF_STORAGE_PACKED) {
+			filter->buf0_size = PACKED_SAMPLES(buf_size);
+			filter->buf0_storage = BUF_STORAGE_PACKED;
+		} else if (param3 == BUF_STORAGE_ULAW) {
+			filter->buf0_size = ULAW_SAMPLES(buf_size);
+			filter->buf0_size_mask = filter->buf0_size - 1;
+			filter->buf0_storage = BUF_STORAGE_ULAW;
+		}
+	}
+	// If filter has two buffers, allocate the second.
 	if (multi_input) {
 		filter->buf1_size = buf_size;
 		filter->buf1_size_mask = buf_size - 1;
 		filter->buf1_head_index = 0;
-		filter->buf1 = new_buf1;
+		filter->buf1_valid = 0;
+		filter->buf1 = alloc_buf(buf_size);
+		if (filter->buf1 == NULL) {
+			return NULL;
+		}
 	}
 
 	// Set filter parameters.
@@ -777,15 +969,139 @@ struct filter *new_filter(uint16_t *filter_buf)
 	filter->param1 = param1;
 	filter->param2 = param2;
 	filter->param3 = param3;
+	// A new filter starts at its targets, only later updates ramp.
+	filter->param_target[0] = param0;
+	filter->param_target[1] = param1;
+	filter->param_target[2] = param2;
+	filter->param_target[3] = param3;
+	filter->params_moving = 0;
+
+	filter_bind(filter);
 
 	return filter;
 }
 
 struct queue *q;
 
+// Estimate the cycles one filter will take per sample from its specification.
+uint32_t filter_cost(uint16_t *filter_buf)
+{
+	uint16_t filter_functions_index = filter_buf[0];
+	uint32_t cost;
+
+	// not a filter, it won't be built
+	if (filter_functions_index >= sizeof(filter_functions) / sizeof(filter_functions[0])) {
+		return 0;
+	}
+	cost = filter_function_costs[filter_functions_index];
+
+	// noise cancellation averages param1 previous samples every sample, no more
+	// than its buffer holds
+	if (filter_functions[filter_functions_index] == noise_cancellation_function) {
+		uint32_t samples = filter_buf[5] < NOISE_BUFFER_SIZE ? filter_buf[5] : NOISE_BUFFER_SIZE;
+		cost += samples * NOISE_CANCELLATION_SAMPLE_COST;
+	}
+
+	// the guitar channels are decimated anyway, the microphone only when read
+	if (filter_functions[filter_functions_index] == channel_function && filter_buf[4] >= 2) {
+		cost += ADC_CHANNEL_COST;
+	}
+
+	// a ramp step may land on any sample
+	if (filter_function_smoothing[filter_functions_index]) {
+		cost += PARAM_RAMP_COST;
+	}
+
+	return cost < FILTER_COST_MAX ? cost : FILTER_COST_MAX;
+}
+
+// Estimate the cycles the timer interrupt will take per sample running this chain.
+uint32_t filter_chain_cost(uint16_t *filters_buf, uint16_t filters_count)
+{
+	uint32_t cost = ISR_OVERHEAD_COST;
+	uint16_t i, controls = 0;
+	for (i = 0; i < filters_count; i++) {
+		uint16_t type = filters_buf[i*8];
+		cost += filter_cost(&filters_buf[i*8]);
+		if (type < sizeof(filter_functions) / sizeof(filter_functions[0]) && filter_control_functions[type] != NULL) {
+			controls++;
+		}
+	}
+	return cost + filter_control_cost(controls);
+}
+
+// Can a chain run at the current frequency? Chains which can't be processed
+// within one sample period are refused before anything is allocated, the caller
+// can propose filter_chain_max_frequency() instead.
+uint8_t filter_chain_admitted(uint16_t *filters_buf, uint16_t filters_count)
+{
+	return filter_chain_max_frequency(filter_chain_cost(filters_buf, filters_count)) >= frequency;
+}
+
+// Cycles of the control steps which land on one sample, for a chain with this
+// many filters which have a control (see filter_schedule).
+uint32_t filter_control_cost(uint16_t controls)
+{
+	return ((controls + CONTROL_RATE - 1) / CONTROL_RATE) * CONTROL_STEP_COST;
+}
+
+// Highest sample rate at which a chain of the given cost still leaves
+// ADMISSION_HEADROOM of each sample period free.
+uint32_t filter_chain_max_frequency(uint32_t cost)
+{
+	return ((SystemCoreClock / 100) * ADMISSION_HEADROOM) / cost;
+}
+
+// Replace the cost estimates of the filter types in the running chain with the
+// mean measured by the profiler, so admission control tracks the actual build
+// rather than the defaults above. The maximum would let one sample which was
+// interrupted or ran late inflate a cost for good.
+void filter_cost_calibrate()
+{
+	#if PROFILE==1
+	struct queue_element *element;
+	if (q == NULL) {
+		return;
+	}
+	for (element = q->head; element != NULL; element = element->next) {
+		struct filter *filter = element->value;
+		uint32_t measured = profile_mean(&filter->profile);
+
+		// not run yet, nothing to learn from
+		if (measured == 0)
+			continue;
+
+		// a variant made for one case (see filter_bind) doesn't speak for the others
+		if (filter->filter_function != filter_functions[filter->filter_type])
+			continue;
+
+		if (filter->filter_function == noise_cancellation_function) {
+			uint32_t averaging = filter->param1 * NOISE_CANCELLATION_SAMPLE_COST;
+			if (measured <= averaging)
+				continue;
+			measured -= averaging;
+		}
+
+		filter_function_costs[filter->filter_type] = measured < FILTER_COST_MAX ? measured : FILTER_COST_MAX;
+	}
+	#endif
+}
+
+// Forget the running chain, whose structs are about to be freed or reused. Until
+// another is built there is no queue to run, plan, profile or update (see timer_start).
+void filter_chain_clear()
+{
+	q = NULL;
+	#ifdef COMPILED_CHAIN
+	compiled_chain_active = 0;
+	#endif
+}
+
 // Input and output filters need to be included in filters_buf.
 // Input filter must be index 0 and filter_id 0.
 // Output filter must be index 1 and filter_id 1.
+// Returns 1-4 for a graph which can't be linked, 5 if admission control refuses
+// it, 6 when out of memory and 8 for a chain without filters.
 uint16_t filter_init(uint16_t *filters_buf, uint16_t filters_count)
 {
 	// Initialise constants for high/low/all-pass filters.
@@ -798,6 +1114,26 @@ uint16_t filter_init(uint16_t *filters_buf, uint16_t filters_count)
 	tty_writeln("Filter functions init");
 	#endif
 
+	// The caller has freed the old chain, so whatever the outcome it is gone.
+	filter_chain_clear();
+
+	if (filters_count == 0) {
+		return 8;
+	}
+
+	// Refuse chains which can't be processed within one sample period at the
+	// current frequency before anything is allocated.
+	if (!filter_chain_admitted(filters_buf, filters_count)) {
+		#if DEBUG==1
+		tty_writeln("ERROR. Filter chain is too slow for the current frequency");
+		#endif
+		return 5;
+	}
+
+	// Everything allocated from here on is released again if the build fails.
+	struct alloc_checkpoint checkpoint;
+	alloc_checkpoint(&checkpoint);
+
 	uint16_t i;
 
 	// Initialise array of filter struct pointers.
@@ -818,6 +1154,13 @@ uint16_t filter_init(uint16_t *filters_buf, uint16_t filters_count)
 	for (i = 0; i < filters_count; i++) {
 		// Allocate and set parameters upon a filter struct for each filter, add to array.
 		struct filter *cur_filter = new_filter(&filters_buf[i*8]);
+		if (cur_filter == NULL) {
+			#if DEBUG==1
+			tty_writeln("ERROR. Out of memory for filter chain");
+			#endif
+			alloc_rollback(&checkpoint);
+			return 6;
+		}
 		uint16_t index = filter_id_to_i(filter_ids, filters_count, cur_filter->filter_id);
 		filters[index] = cur_filter;
 	}
@@ -846,6 +1189,7 @@ uint16_t filter_init(uint16_t *filters_buf, uint16_t filters_count)
 				tty_write("ERROR. A third filter is trying to write to filter ID ");
 				tty_writeln_int((int) filter_next_id);
 				#endif
+				alloc_rollback(&checkpoint);
 				return 1;
 			}
 			if (filter_next_id == i){ //Check if a filter is outputting to itself
@@ -854,6 +1198,7 @@ uint16_t filter_init(uint16_t *filters_buf, uint16_t filters_count)
 				tty_writeln_int((int) filter_next_id);
 				tty_writeln_int((int) i);
 				#endif
+				alloc_rollback(&checkpoint);
 				return 2;
 			}
 			// Set next filter, buffer index in next filter. Register reference to that filter.
@@ -867,6 +1212,7 @@ uint16_t filter_init(uint16_t *filters_buf, uint16_t filters_count)
 				tty_write("ERROR. A third filter is trying to write to filter ID ");
 				tty_writeln_int((int) filter_next2_id);
 				#endif
+				alloc_rollback(&checkpoint);
 				return 3;
 			}
 			if (filter_next2_id == i){
@@ -874,6 +1220,7 @@ uint16_t filter_init(uint16_t *filters_buf, uint16_t filters_count)
 				tty_write("ERROR. A filter is trying to output to itself. Filter ID: ");
 				tty_writeln_int((int) filter_next2_id);
 				#endif
+				alloc_rollback(&checkpoint);
 				return 4;
 			}
 			filters[i]->next2 = filters[filter_next2_id];
@@ -895,30 +1242,507 @@ uint16_t filter_init(uint16_t *filters_buf, uint16_t filters_count)
 	// only once in order to make ADC sampling complete faster (allowing
 	// more complex filter chains and higher sampling frequency).
 	q = new_queue();
+	if (q == NULL) {
+		alloc_rollback(&checkpoint);
+		return 6;
+	}
 	struct filter *current_filter;
+	uint16_t full = 0;
 
 	// Add head_filter to the queue.
-	enqueue(q, head_filter);
+	full |= enqueue(q, head_filter);
+
+	// Nothing writes to the other inputs, so they are queued up front as well.
+	for (i = 0; i < filters_count; i++) {
+		if (filters[i] != head_filter && filter_refcount[i] == 0 &&
+				(filters[i]->filter_function == input_function || filters[i]->filter_function == channel_function)) {
+			full |= enqueue(q, filters[i]);
+		}
+	}
 
 	// Recurse tree adding filters to queue.
-	while((current_filter = get_element(q)))
+	while(!full && (current_filter = get_element(q)))
 	{
 		// Only enqueue when next_buf_n is 0 or we will end up running filters with
 		// multiple inputs twice
 		if(current_filter->next != NULL && current_filter->next_buf_n == 0){
-			enqueue(q, current_filter->next);
+			full |= enqueue(q, current_filter->next);
 		}
 		if(current_filter->next2 != NULL && current_filter->next2_buf_n == 0){
-			enqueue(q, current_filter->next2);
+			full |= enqueue(q, current_filter->next2);
 		}
 
 		move_to_next(q);
 	}
 
+	// out of queue elements, the queue isn't a chain that can run
+	if (full) {
+		#if DEBUG==1
+		tty_writeln("ERROR. Out of memory for filter queue");
+		#endif
+		filter_chain_clear();
+		alloc_rollback(&checkpoint);
+		return 6;
+	}
+
 	#if DEBUG==1
 	tty_writeln("Finished filter queuing");
 	#endif
 
+	filter_fuse();
+	filter_schedule();
+
+	#if PROFILE==1
+	profile_reset(&isr_profile);
+	#endif
+
+	return 0;
+}
+
+// The filter after another in the run fused into first's table, or NULL after the
+// last of the run. Filters which aren't fused are a run of their own.
+struct filter *filter_fused_next(struct filter *first, struct filter *filter)
+{
+	if (first->fused_table == NULL || filter == first->fused_last) {
+		return NULL;
+	}
+	return filter->next;
+}
+
+// First filter of the run a filter of the running chain is fused into, or NULL if
+// it isn't part of one.
+struct filter *filter_fused_first(struct filter *filter)
+{
+	return filter->fused_first;
+}
+
+// Work out the table of a fused run again. It is written an entry at a time, so
+// while parameters change the interrupt reads each sample's old or new value.
+void filter_fuse_table(struct filter *first)
+{
+	uint16_t v;
+	for (v = 0; v < FUSED_TABLE_SIZE; v++) {
+		first->fused_table[v] = filter_fused_apply(first, v);
+	}
+}
+
+// Fuse each run of two or more filters which map one sample to another (see
+// filter_point_functions), each writing only to the next, into a table of what
+// the whole run makes of every sample, taken from the sample pool. The first of
+// the run looks it up and the others leave the queue. Runs are left as they are
+// if there is no memory for a table.
+void filter_fuse()
+{
+	struct queue_element *element, *removed;
+	struct filter *member;
+
+	for (element = q->head; element != NULL; element = element->next) {
+		struct filter *first = element->value, *last = first;
+
+		// members of a run fused further up the queue are left for below
+		if (filter_point_functions[first->filter_type] == NULL || first->fused_first != NULL) {
+			continue;
+		}
+		while (last->next != NULL && last->next2 == NULL && last->next_buf_n == 0 &&
+				filter_point_functions[last->next->filter_type] != NULL) {
+			last = last->next;
+		}
+		if (last == first) {
+			continue;
+		}
+		first->fused_table = alloc_buf(FUSED_TABLE_SIZE);
+		if (first->fused_table == NULL) {
+			continue;
+		}
+		first->fused_last = last;
+		filter_fuse_table(first);
+		filter_bind(first);
+
+		for (member = first; member != NULL; member = filter_fused_next(first, member)) {
+			member->fused_first = first;
+		}
+	}
+
+	// the rest of each run only runs as part of the table, the head never is one
+	for (element = q->head; element != NULL && element->next != NULL; ) {
+		removed = element->next;
+		member = removed->value;
+		if (member->fused_first != NULL && member->fused_first != member) {
+			if (q->tail == removed) {
+				q->tail = element;
+			}
+			element->next = removed->next;
+			free_queue_element(removed);
+		} else {
+			element = removed;
+		}
+	}
+}
+
+// Spread the controls of the running chain over the control period, one slot
+// after the other, so a sample never steps more than its share of them. Each
+// starts at its current value and holds it until its first step.
+void filter_schedule()
+{
+	struct queue_element *element;
+	uint16_t i, controls = 0;
+
+	for (i = 0; i < CONTROL_RATE; i++) {
+		control_slots[i] = NULL;
+	}
+	for (element = q->head; element != NULL; element = element->next) {
+		struct filter *filter = element->value;
+		// scheduled by type, an update can give an LFO a control (see filter_bind)
+		if (filter_control_functions[filter->filter_type] == NULL) {
+			continue;
+		}
+		uint16_t slot = controls++ % CONTROL_RATE;
+		filter->control = filter->control_function != NULL ? filter->control_function(filter, cycle) : 0;
+		filter->control_step = 0;
+		filter->control_next = control_slots[slot];
+		control_slots[slot] = filter;
+	}
+
+	filter_channels();
+
+	#ifdef COMPILED_CHAIN
+	compiled_chain_active = filter_chain_compiled();
+	if (compiled_chain_active) {
+		compiled_chain_start();
+	}
+	#endif
+}
+
+// Have the ADC decimate the channels the running chain reads.
+void filter_channels()
+{
+	struct queue_element *element;
+	uint16_t channels = 0;
+
+	for (element = q->head; element != NULL; element = element->next) {
+		struct filter *filter = element->value;
+		if (filter->filter_function == channel_function && filter->param0 < ADC_CHANNELS) {
+			channels |= 1 << filter->param0;
+		}
+	}
+	adc_enable(channels);
+}
+
+#ifdef COMPILED_CHAIN
+// Whether the chain in filters_buf is the one compiled in (see gui/chain2c.py),
+// parameters and all, so the compiled code can run it.
+uint8_t filter_chain_compiled()
+{
+	uint16_t i;
+
+	if (filters_count != COMPILED_CHAIN_FILTERS) {
+		return 0;
+	}
+	for (i = 0; i < COMPILED_CHAIN_FILTERS*8; i++) {
+		if (filters_buf[i] != compiled_chain_spec[i]) {
+			return 0;
+		}
+	}
+	return 1;
+}
+#endif
+
+// Work out a filter's control where it will be a control period from now, and
+// the step which takes it there in a straight line.
+void filter_control_step(struct filter *filter)
+{
+	if (filter->control_function == NULL) {
+		return;
+	}
+	float target = filter->control_function(filter, (uint32_t)cycle + CONTROL_RATE);
+	filter->control_step = (target - filter->control) * (1.0f / CONTROL_RATE);
+}
+
+// Bytes in the compiled plan of the running chain, 0 if no chain was built.
+// Plans keep the filters of fused runs, right after the first of each, and
+// filter_plan_load() fuses them again.
+uint32_t filter_plan_length()
+{
+	struct queue_element *element;
+	struct filter *filter;
+	uint32_t count = 0;
+
+	if (q == NULL) {
+		return 0;
+	}
+	for (element = q->head; element != NULL; element = element->next) {
+		for (filter = element->value; filter != NULL; filter = filter_fused_next(element->value, filter)) {
+			count++;
+		}
+	}
+	return sizeof(struct plan) + count * sizeof(struct plan_filter);
+}
+
+// Index in execution order of a filter of the running chain, or PLAN_NONE.
+uint8_t filter_plan_index(struct filter *filter)
+{
+	struct queue_element *element;
+	struct filter *member;
+	uint8_t i = 0;
+
+	if (filter == NULL) {
+		return PLAN_NONE;
+	}
+	for (element = q->head; element != NULL; element = element->next) {
+		for (member = element->value; member != NULL; member = filter_fused_next(element->value, member), i++) {
+			if (member == filter) {
+				return i;
+			}
+		}
+	}
+	return PLAN_NONE;
+}
+
+// Compile the running chain into a plan, handing it to put a piece at a time.
+// Parameters are the targets they are ramping to, as in filters_buf. Returns the
+// first error put returns.
+uint16_t filter_plan_write(uint16_t (*put)(uint8_t *bytes, uint32_t length))
+{
+	struct queue_element *element;
+	struct filter *filter;
+	struct plan plan;
+	uint16_t i, error;
+
+	plan.magic = PLAN_MAGIC;
+	plan.version = PLAN_VERSION;
+	plan.count = (filter_plan_length() - sizeof(struct plan)) / sizeof(struct plan_filter);
+	error = put((uint8_t *)&plan, sizeof(struct plan));
+
+	// walked without touching q->current, which belongs to filter_loop
+	for (element = q->head; element != NULL && !error; element = element->next) {
+		for (filter = element->value; filter != NULL && !error; filter = filter_fused_next(element->value, filter)) {
+			struct plan_filter entry;
+
+			entry.type = filter->filter_type;
+			entry.filter_id = filter->filter_id;
+			entry.next = filter_plan_index(filter->next);
+			entry.next_buf_n = filter->next_buf_n;
+			entry.next2 = filter_plan_index(filter->next2);
+			entry.next2_buf_n = filter->next2_buf_n;
+			for (i = 0; i < 4; i++) {
+				entry.params[i] = filter->param_target[i];
+			}
+			entry.buf0_size = filter->buf0_size;
+			error = put((uint8_t *)&entry, sizeof(struct plan_filter));
+		}
+	}
+	return error;
+}
+
+// Build the chain of a compiled plan, read where it lies in flash. Filters are
+// allocated and linked in execution order and queued as they are; nothing is
+// looked up or checked but what this firmware might disagree with. Returns the
+// errors of filter_init(), or 7 if the plan was made by a different firmware,
+// which filter_init() can then build the chain for instead.
+uint16_t filter_plan_load(struct plan *plan)
+{
+	struct plan_filter *entries = (struct plan_filter *)(plan + 1);
+	uint16_t spec[8], i, j, controls = 0;
+	uint32_t cost = ISR_OVERHEAD_COST;
+
+	filter_chain_clear();
+
+	if (plan->magic != PLAN_MAGIC || plan->version != PLAN_VERSION || plan->count == 0) {
+		return 7;
+	}
+	for (i = 0; i < plan->count; i++) {
+		if (entries[i].type >= sizeof(filter_functions) / sizeof(filter_functions[0])) {
+			return 7;
+		}
+	}
+
+	// the costs may have been calibrated since the plan was made
+	for (i = 0; i < plan->count; i++) {
+		spec[0] = entries[i].type;
+		for (j = 0; j < 4; j++) {
+			spec[4 + j] = entries[i].params[j];
+		}
+		cost += filter_cost(spec);
+		if (filter_control_functions[spec[0]] != NULL) {
+			controls++;
+		}
+	}
+	if (filter_chain_max_frequency(cost + filter_control_cost(controls)) < frequency) {
+		return 5;
+	}
+
+	aec_highpass_constants(2000, 1, 10);
+	aec_lowpass_constants(2000, 1000, 1000);
+	aec_allpass_constants(2000, 1, 10);
+
+	struct alloc_checkpoint checkpoint;
+	alloc_checkpoint(&checkpoint);
+
+	struct filter *filters[plan->count];
+	for (i = 0; i < plan->count; i++) {
+		spec[0] = entries[i].type;
+		spec[1] = entries[i].filter_id;
+		for (j = 0; j < 4; j++) {
+			spec[4 + j] = entries[i].params[j];
+		}
+		filters[i] = new_filter(spec);
+		if (filters[i] == NULL) {
+			alloc_rollback(&checkpoint);
+			return 6;
+		}
+		if (filters[i]->buf0_size != entries[i].buf0_size) {
+			alloc_rollback(&checkpoint);
+			return 7;
+		}
+	}
+
+	for (i = 0; i < plan->count; i++) {
+		if (entries[i].next < plan->count) {
+			filters[i]->next = filters[entries[i].next];
+			filters[i]->next_buf_n = entries[i].next_buf_n;
+		}
+		if (entries[i].next2 < plan->count) {
+			filters[i]->next2 = filters[entries[i].next2];
+			filters[i]->next2_buf_n = entries[i].next2_buf_n;
+		}
+	}
+
+	struct queue *plan_queue = new_queue();
+	if (plan_queue == NULL) {
+		alloc_rollback(&checkpoint);
+		return 6;
+	}
+	for (i = 0; i < plan->count; i++) {
+		if (enqueue(plan_queue, filters[i]) != 0) {
+			alloc_rollback(&checkpoint);
+			return 6;
+		}
+	}
+	head_filter = filters[0];
+	q = plan_queue;
+	filter_fuse();
+	filter_schedule();
+
+	#if PROFILE==1
+	profile_reset(&isr_profile);
+	#endif
+
+	return 0;
+}
+
+// Pointer to paramn of a filter.
+uint16_t *filter_param(struct filter *filter, uint16_t index)
+{
+	switch (index) {
+	case 0: return &filter->param0;
+	case 1: return &filter->param1;
+	case 2: return &filter->param2;
+	default: return &filter->param3;
+	}
+}
+
+// Move each ramping parameter of a filter one unit towards its target, clearing
+// its bit in params_moving once it gets there. Called from the timer interrupt.
+void filter_params_step(struct filter *filter)
+{
+	uint16_t i;
+	uint8_t bind = 0;
+	for (i = 0; i < 4; i++) {
+		if (filter->params_moving & (1 << i)) {
+			uint16_t *param = filter_param(filter, i);
+			uint16_t target = filter->param_target[i];
+			uint16_t from = *param;
+			if (*param < target) {
+				(*param)++;
+			} else if (*param > target) {
+				(*param)--;
+			}
+			if (*param == target) {
+				filter->params_moving &= ~(1 << i);
+			}
+			bind |= filter_binds_on(filter, i, from) || filter_binds_on(filter, i, *param);
+		}
+	}
+	// most steps leave the variant as it is
+	if (bind) {
+		filter_bind(filter);
+	}
+}
+
+// Filter of the running chain with the given id, or NULL.
+struct filter *filter_find(uint16_t filter_id)
+{
+	uint16_t i;
+	// the chain's filters are the live ones below the top of the pool
+	for (i = 0; i < filter_alloc.top; i++) {
+		if (filter_alloc_pool[i].filter_id == filter_id && filter_pool_live(&filter_alloc_pool[i])) {
+			return &filter_alloc_pool[i];
+		}
+	}
+	return NULL;
+}
+
+// Change one parameter of a filter in the running chain. Smoothed parameters
+// (see filter_function_smoothing) ramp to the new value, others take it at the
+// next sample. filters_buf is updated too, so download and save see it. Filters
+// of a fused run take the value at once and the run's table is worked out again.
+// Returns 1 if there is no such filter or parameter, or no chain is built, or if
+// the parameter is set when the filter is built: how a delay line stores samples.
+uint16_t filter_update(uint16_t filter_id, uint16_t index, uint16_t value)
+{
+	uint16_t i;
+	struct filter *filter, *fused_first;
+
+	if (q == NULL || index > 3) {
+		return 1;
+	}
+
+	filter = filter_find(filter_id);
+	if (filter == NULL) {
+		return 1;
+	}
+	// its buffer was laid out for it by new_filter(), the chain has to be applied again
+	if (index == 3 && (filter_functions[filter->filter_type] == delay_function ||
+			filter_functions[filter->filter_type] == reverb_function)) {
+		return 1;
+	}
+
+	for (i = 0; i < filters_count; i++) {
+		if (filters_buf[i*8 + 1] == filter_id) {
+			filters_buf[i*8 + 4 + index] = value;
+		}
+	}
+
+	// The interrupt only ever clears bits of params_moving, and only once the
+	// parameter has reached its target, so a clear lost to this read-modify-write
+	// is simply redone at the next step.
+	fused_first = filter_fused_first(filter);
+	filter->param_target[index] = value;
+	if (fused_first == NULL && (filter_function_smoothing[filter->filter_type] & (1 << index))) {
+		filter->params_moving |= 1 << index;
+	} else {
+		// the interrupt binds as parameters ramp, it mustn't do so in between
+		__disable_irq();
+		filter->params_moving &= ~(1 << index);
+		*filter_param(filter, index) = value;
+		filter_bind(filter);
+		__enable_irq();
+	}
+
+	if (fused_first != NULL) {
+		filter_fuse_table(fused_first);
+	}
+
+	// a channel input moved to another channel
+	if (filter->filter_function == channel_function) {
+		filter_channels();
+	}
+
+	#ifdef COMPILED_CHAIN
+	// the compiled chain has its parameters built in, the queue runs any others
+	compiled_chain_active = filter_chain_compiled();
+	#endif
+
 	return 0;
 }
 
@@ -932,10 +1756,33 @@ inline void filter_loop()
 
 	// Operating on a queue of filter structs, loop through applying the functions.
 	struct filter *current_filter;
+	// parameters still ramping take a step every PARAM_RAMP_INTERVAL samples
+	uint16_t ramp = (cycle & (PARAM_RAMP_INTERVAL-1)) == 0;
+
+	// control-rate work of this sample's slot, left out of the filters' profiles
+	control_slot = (control_slot + 1) & (CONTROL_RATE-1);
+	for (current_filter = control_slots[control_slot]; current_filter != NULL; current_filter = current_filter->control_next) {
+		filter_control_step(current_filter);
+	}
+
+	#if PROFILE==1
+	// The end of one filter is the start of the next, so only one CYCCNT read is
+	// needed per filter.
+	uint32_t start = DWT->CYCCNT, end;
+	#endif
 	move_to_start(q);
 	while((current_filter = get_element(q)))
 	{
+		// settled filters skip the ramp with a single test
+		if (current_filter->params_moving && ramp) {
+			filter_params_step(current_filter);
+		}
 		current_filter->filter_function(current_filter);
+		#if PROFILE==1
+		end = DWT->CYCCNT;
+		profile_record(&current_filter->profile, end - start);
+		start = end;
+		#endif
 		move_to_next(q);
 	}
 
@@ -6,6 +6,11 @@ uint16_t filters_buf[2048];
 
 struct filter *head_filter;
 
+#ifdef COMPILED_CHAIN
+// Set while the chain built is the one compiled in, which then runs instead.
+uint8_t compiled_chain_active;
+#endif
+
 #define REGULAR_BUFFER_SIZE 16 
 #define DELAY_BUFFER_SIZE 4096
 #define FLANGE_BUFFER_SIZE 256
@@ -34,8 +39,36 @@ void noise_cancellation_function(struct filter *filter);
 void aec_lowpass_function(struct filter *filter);
 void aec_highpass_function(struct filter *filter);
 void aec_allpass_function(struct filter *filter);
+void channel_function(struct filter *filter);
+
+void reverb_packed_function(struct filter *filter);
+void reverb_ulaw_function(struct filter *filter);
+void delay_packed_function(struct filter *filter);
+void delay_ulaw_function(struct filter *filter);
+void mix_buf0_function(struct filter *filter);
+void mix_buf1_function(struct filter *filter);
+void tremolo_triangle_function(struct filter *filter);
+void tremolo_square_function(struct filter *filter);
+void tremolo_upward_saw_function(struct filter *filter);
+void tremolo_downward_saw_function(struct filter *filter);
+void flange_triangle_function(struct filter *filter);
+void flange_square_function(struct filter *filter);
+void flange_upward_saw_function(struct filter *filter);
+void flange_downward_saw_function(struct filter *filter);
+void fused_function(struct filter *filter);
+
+uint16_t max_point(struct filter *filter, uint16_t v);
+uint16_t min_point(struct filter *filter, uint16_t v);
+uint16_t upward_compressor_point(struct filter *filter, uint16_t v);
+uint16_t downward_compressor_point(struct filter *filter, uint16_t v);
+uint16_t n_bits_point(struct filter *filter, uint16_t v);
+uint16_t distortion_point(struct filter *filter, uint16_t v);
+
+float reverb_control(struct filter *filter, uint32_t t);
+float tremolo_control(struct filter *filter, uint32_t t);
+float flange_control(struct filter *filter, uint32_t t);
 
-void (*filter_functions[21])(struct filter *filter) = {
+void (*filter_functions[22])(struct filter *filter) = {
 	input_function,					//0
 	output_function,				//1
 	passthrough_function, 			//2
@@ -57,12 +90,13 @@ void (*filter_functions[21])(struct filter *filter) = {
 	aec_lowpass_function,			//18
 	aec_highpass_function,			//19
 	aec_allpass_function,			//20
+	channel_function,				//21
 };
 
 // To ensure filters can access a good number of previous outputs, filters
 // should have a buffer size of at least 16.
 // They need to be a power of two
-uint32_t filter_function_sizes[21] = {
+uint32_t filter_function_sizes[22] = {
 	REGULAR_BUFFER_SIZE,		//0
 	REGULAR_BUFFER_SIZE,		//1
 	REGULAR_BUFFER_SIZE,		//2
@@ -84,9 +118,224 @@ uint32_t filter_function_sizes[21] = {
 	PASS_BUFFER_SIZE,			//18
 	PASS_BUFFER_SIZE,			//19
 	PASS_BUFFER_SIZE,			//20
+	REGULAR_BUFFER_SIZE,		//21
+};
+
+// Worst-case cycles per sample of each filter function, used by admission control
+// to refuse chains the timer interrupt can't keep up with. Measured with the
+// profile command at -O0 and refined at run time by filter_cost_calibrate().
+// Parameter-dependent costs are added on top in filter_cost().
+uint32_t filter_function_costs[22] = {
+	180,		//0
+	140,		//1
+	110,		//2
+	70,			//3
+	130,		//4
+	130,		//5
+	3900,		//6
+	900,		//7
+	520,		//8
+	280,		//9
+	700,		//10
+	800,		//11
+	560,		//12
+	560,		//13
+	140,		//14
+	520,		//15
+	760,		//16
+	260,		//17
+	1600,		//18
+	1600,		//19
+	1600,		//20
+	120,		//21
+};
+
+// Parameters of each filter function that ramp to a new value instead of
+// jumping, bit n for paramn. Gains, depths and thresholds click when stepped;
+// lengths, frequencies and modes aren't smoothed.
+uint8_t filter_function_smoothing[22] = {
+	0x0,		//0
+	0x0,		//1
+	0x0,		//2
+	0x0,		//3
+	0x1,		//4
+	0x1,		//5
+	0x1,		//6
+	0x2,		//7
+	0x0,		//8
+	0x1,		//9
+	0x1,		//10
+	0x0,		//11
+	0x3,		//12
+	0x3,		//13
+	0x0,		//14
+	0x1,		//15
+	0x2,		//16
+	0x0,		//17
+	0x0,		//18
+	0x0,		//19
+	0x0,		//20
+	0x0,		//21
+};
+
+// Control of each filter function which changes slowly, NULL for those which
+// have none. Run at control rate, once every CONTROL_RATE samples, for its value
+// at a given sample; the filter function interpolates it in between. Only sines
+// are smooth enough for that, filter_bind() drops the control of other LFOs.
+float (*filter_control_functions[22])(struct filter *filter, uint32_t t) = {
+	NULL,				//0
+	NULL,				//1
+	NULL,				//2
+	NULL,				//3
+	NULL,				//4
+	NULL,				//5
+	NULL,				//6
+	reverb_control,		//7
+	NULL,				//8
+	NULL,				//9
+	tremolo_control,	//10
+	flange_control,		//11
+	NULL,				//12
+	NULL,				//13
+	NULL,				//14
+	NULL,				//15
+	NULL,				//16
+	NULL,				//17
+	NULL,				//18
+	NULL,				//19
+	NULL,				//20
+	NULL,				//21
+};
+
+// Variants filter_bind() picks from, made for one case of what the filter function
+// or control otherwise tests every time. Delays and reverbs by how their buffer
+// stores samples, BUF_STORAGE_* (see alloc.c); tremolos and flanges by LFO
+// type, 1 - triangle, 2 - square, 3 - upward saw, 4 - downward saw, 0 - sine.
+#define LFO_TYPES 5
+
+void (*delay_functions[3])(struct filter *filter) = {
+	delay_function,
+	delay_packed_function,
+	delay_ulaw_function,
+};
+
+void (*reverb_functions[3])(struct filter *filter) = {
+	reverb_function,
+	reverb_packed_function,
+	reverb_ulaw_function,
+};
+
+void (*tremolo_functions[LFO_TYPES])(struct filter *filter) = {
+	tremolo_function,
+	tremolo_triangle_function,
+	tremolo_square_function,
+	tremolo_upward_saw_function,
+	tremolo_downward_saw_function,
+};
+
+void (*flange_functions[LFO_TYPES])(struct filter *filter) = {
+	flange_function,
+	flange_triangle_function,
+	flange_square_function,
+	flange_upward_saw_function,
+	flange_downward_saw_function,
+};
+
+// Maps of the filters whose output sample depends only on their input sample, NULL
+// for others. Runs of them are fused into one table (see filter_fuse).
+uint16_t (*filter_point_functions[22])(struct filter *filter, uint16_t v) = {
+	NULL,				//0
+	NULL,				//1
+	NULL,				//2
+	NULL,				//3
+	max_point,			//4
+	min_point,			//5
+	NULL,				//6
+	NULL,				//7
+	NULL,				//8
+	NULL,				//9
+	NULL,				//10
+	NULL,				//11
+	upward_compressor_point,	//12
+	downward_compressor_point,	//13
+	n_bits_point,			//14
+	distortion_point,		//15
+	NULL,				//16
+	NULL,				//17
+	NULL,				//18
+	NULL,				//19
+	NULL,				//20
+	NULL,				//21
+};
+
+#define CONTROL_RATE 32 // samples between steps of a filter's control, a power of two
+#define CONTROL_STEP_COST 4200 // cycles for filter_control_step, the sine of an LFO
+
+// Filters whose control steps at each sample of the control period, linked by
+// control_next. Controls are spread over the slots so each sample does the same work.
+struct filter *control_slots[CONTROL_RATE];
+uint16_t control_slot; // Slot of the current sample.
+
+#define PARAM_RAMP_INTERVAL 16 // samples between ramp steps of one unit, a power of two
+#define PARAM_RAMP_COST 60 // cycles for filter_params_step, added to filters with smoothed parameters
+#define NOISE_CANCELLATION_SAMPLE_COST 70 // cycles for each sample averaged by noise_cancellation_function
+#define ADC_CHANNEL_COST 240 // cycles to decimate one ADC channel, done by adc_sample() for each channel read
+#define ISR_OVERHEAD_COST (260 + 2 * ADC_CHANNEL_COST) // cycles per sample spent in DMA_IRQHandler outside filter_loop, decimating the guitar among them
+#define FILTER_COST_MAX 1000000 // cycles, more than any filter takes in a sample period; bounds the sum over a chain
+#define ADMISSION_HEADROOM 85 // percentage of each sample period the chain may use, the rest is left for serial
+
+// Compiled plan of a chain, saved with presets (see preset.c) so loading one can
+// skip checking, ordering and linking the graph as filter_init() does. A struct plan
+// followed by a plan_filter for each filter, in execution order. Filters which
+// aren't reachable from the input never run, so they aren't in the plan.
+#define PLAN_MAGIC 0x4C50 // "PL"
+#define PLAN_VERSION 1 // Changed whenever the layout or meaning of a plan changes.
+#define PLAN_NONE 0xFF // Index of a missing next filter.
+
+struct plan
+{
+	uint16_t magic; // PLAN_MAGIC.
+	uint8_t version; // PLAN_VERSION.
+	uint8_t count; // Filters in the plan.
+};
+
+struct plan_filter
+{
+	uint8_t type; // Index in filter_functions.
+	uint8_t filter_id;
+	uint8_t next; // Index in the plan of the first next filter, or PLAN_NONE.
+	uint8_t next_buf_n; // Buffer of the first next filter written to.
+	uint8_t next2; // Index in the plan of the second next filter, or PLAN_NONE.
+	uint8_t next2_buf_n;
+	uint8_t params[4];
+	uint16_t buf0_size; // Samples in the first buffer, which new_filter() must agree with.
 };
 
+void filter_bind(struct filter *filter);
+uint8_t filter_binds_on(struct filter *filter, uint16_t index, uint16_t value);
+void filter_chain_clear();
+struct filter *filter_fused_next(struct filter *first, struct filter *filter);
+struct filter *filter_fused_first(struct filter *filter);
+uint16_t filter_fused_apply(struct filter *filter, uint16_t v);
+void filter_fuse_table(struct filter *first);
+void filter_fuse();
+uint32_t filter_cost(uint16_t *filter_buf);
+uint32_t filter_control_cost(uint16_t controls);
+uint32_t filter_chain_cost(uint16_t *filters_buf, uint16_t filters_count);
+uint32_t filter_chain_max_frequency(uint32_t cost);
+uint8_t filter_chain_admitted(uint16_t *filters_buf, uint16_t filters_count);
+void filter_cost_calibrate();
 uint16_t filter_init(uint16_t *filters_buf, uint16_t filters_count);
+void filter_schedule();
+void filter_channels();
+uint32_t filter_plan_length();
+uint16_t filter_plan_write(uint16_t (*put)(uint8_t *bytes, uint32_t length));
+uint16_t filter_plan_load(struct plan *plan);
+struct filter *filter_find(uint16_t filter_id);
+uint16_t filter_update(uint16_t filter_id, uint16_t index, uint16_t value);
 inline void filter_loop();
+#ifdef COMPILED_CHAIN
+uint8_t filter_chain_compiled();
+#endif
 
 #endif
\ No newline at end of file
@@ -153,7 +153,7 @@ void copy_ram_flash(uint16_t *src_addr, uint16_t *dest_addr, int size){
   command[1] = (unsigned) dest_addr;
   command[2] = (unsigned) src_addr;
   command[3] = (unsigned) size;
-  command[4] = (unsigned) 100000; // CPU Clock Freq of MBED in KHz
+  command[4] = SystemCoreClock / 1000; // CPU Clock Freq of MBED in KHz
 
   iap_entry(command,output);
 }
@@ -167,7 +167,7 @@ void erase_sector(int start, int end){
   command[0] = 52; // command code
   command[1] = (unsigned) start;
   command[2] = (unsigned) end;
-  command[3] = 72000; // CPU Clock Freq of MBED in KHz
+  command[3] = SystemCoreClock / 1000; // CPU Clock Freq of MBED in KHz
 
   iap_entry(command,output);
 }
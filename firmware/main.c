@@ -20,6 +20,9 @@
 
 #define DEBUG 0 //used to print debug messages, cannot be used in cojunction with the GUI
 #define TRACE 0 //used to print filter tracing messages, can only be used in debug mode
+#define PROFILE 1 //used to record per-filter cycle counts, cheap enough to leave enabled
+#define ALLOC_VALIDATE 0 //used to check every sample buffer free against the allocator's bitmaps
+//#define COMPILED_CHAIN "chain.c" //straight-line chain made by gui/chain2c.py, run in place of the queue while it is the chain applied
 
 #include "lpc_types.h"
 #include "lpc17xx_pinsel.h"
@@ -38,13 +41,31 @@
 #define REPL_NOOP_COMMAND '0'
 #define REPL_LOAD_COMMAND 'z'
 #define REPL_SAVE_COMMAND 'x'
+#define REPL_PROFILE_COMMAND 'p'
+#define REPL_XRUN_COMMAND 'o'
+#define REPL_BYPASS_COMMAND 'b'
+#define REPL_MEMORY_COMMAND 'm'
+#define REPL_VERSION_COMMAND 'v'
+#define REPL_UPDATE_COMMAND 'u'
+#define REPL_CAPTURE_COMMAND 'c'
+#define REPL_SCOPE_COMMAND 'r'
+#define REPL_COMMANDS "hgsad0zxpobmvucr" // Commands understood outside of apply, to reject others in the binary protocol.
+
+#define MEMORY_MAP_CELLS 48 // Characters in the map of each sample pool sent by the memory command.
 
 #include "adc.c"
 #include "alloc.c"
 #include "board.c"
+#include "capture.c"
+#include "cic.c"
 #include "dac.c"
+#ifdef COMPILED_CHAIN
+#include COMPILED_CHAIN
+#endif
 #include "filter_chain.c"
 #include "iap.c"
+#include "preset.c"
+#include "profile.c"
 #include "queue.c"
 #include "scramble.c"
 #include "serial.c"
@@ -54,8 +75,7 @@ void do_passthrough(void)
 {
 	timer_stop();
 
-	free_all_filters();
-	free_all_buf();
+	free_all();
 
 	filters_count = 2;
 
@@ -82,12 +102,48 @@ void do_passthrough(void)
 	timer_start();
 }
 
+// Run the chain and sample rate which were running at power off, kept in the
+// preset log by remember_chain(). Returns 1 if there are none or the chain won't build.
+uint16_t do_restore(void)
+{
+	uint16_t count = preset_count(PRESET_LAST);
+	if(count == 0 || preset_frequency(PRESET_LAST) == 0) {
+		return 1;
+	}
+
+	timer_stop();
+
+	free_all();
+
+	frequency = preset_frequency(PRESET_LAST);
+	timer_init(frequency);
+
+	if(preset_build(PRESET_LAST) != 0) {
+		return 1;
+	}
+
+	timer_start();
+
+	return 0;
+}
+
+// Keep the running chain and sample rate in the preset log for do_restore(). Saves
+// which would change nothing are skipped, so applying the same chain again costs no
+// flash, unless they would add the compiled plan the restore builds it from.
+// Called while the timer is stopped: programming flash holds interrupts off for up
+// to a sector erase, and the DAC's DMA would replay its old block all the while.
+void remember_chain(void)
+{
+	if(!preset_equal(PRESET_LAST, filters_buf, filters_count, frequency) || preset_plan(PRESET_LAST) == NULL) {
+		preset_save(PRESET_LAST, filters_buf, filters_count, frequency);
+	}
+}
+
 void do_debug()
 {
 	timer_stop();
 
-	free_all_filters();
-	free_all_buf();
+	free_all();
 
 	filters_count = 5;
 
@@ -154,37 +210,333 @@ void do_debug()
 	timer_start();
 }
 
-void main(void)
+// Report a filter_init() failure of a chain to the GUI. Chains refused by admission
+// control also get the highest frequency they could run at.
+void write_init_error(uint16_t error, uint16_t *chain, uint16_t count)
 {
-	char read_buffer[16];
-	char s[16];
+	char s[32];
 
-	uint16_t skip_reading = 0;
+	if(error == 5) {
+		sprintf(s, "Error: %d Max:%d", error,
+						(int) filter_chain_max_frequency(filter_chain_cost(chain, count)));
+	} else {
+		sprintf(s, "Error: %d", error);
+	}
 
-	serial_init();
-	#if DEBUG==1
-	tty_writeln("Serial Init");
-	#endif
+	tty_writeln(s);
+}
 
-	dac_init();
-	#if DEBUG==1
-	tty_writeln("DAC Init");
-	#endif
+// A new chain is received into filters_buf after the one running, which needs
+// filters_buf no longer than it is running, so that one can carry on if the new
+// one is refused. filters_buf has room for both, as no chain has more filters
+// than FILTER_ALLOC_SIZE.
+uint16_t *staged_chain()
+{
+	return &filters_buf[filters_count*8];
+}
 
-	adc_init();
-	#if DEBUG==1
-	tty_writeln("ADC Init");
-	#endif
+// Check a staged chain (see staged_chain) while the running one still plays, so a
+// chain refused by admission control, with more filters than there are structs for
+// or with none, leaves it running. Returns 0, or 5, 6 or 8 as filter_init() would.
+uint16_t staged_admit(uint16_t count)
+{
+	if(count == 0) {
+		return 8;
+	}
+	if(count > FILTER_ALLOC_SIZE) {
+		return 6;
+	}
+	if(!filter_chain_admitted(staged_chain(), count)) {
+		return 5;
+	}
+	return 0;
+}
 
-	timer_init(frequency);
-	#if DEBUG==1
-	tty_writeln("Timer Init");
+// Replace the running chain with a staged one that was admitted, and run it.
+// Returns the errors of filter_init().
+uint16_t staged_apply(uint16_t count)
+{
+	timer_stop();
+
+	free_all();
+
+	memmove(filters_buf, staged_chain(), count*8*sizeof(filters_buf[0]));
+	filters_count = count;
+
+	uint16_t error = filter_init(filters_buf, filters_count);
+	if(error == 0) {
+		remember_chain();
+
+		timer_start();
+	}
+	return error;
+}
+
+// Finish a binary request whose chain failed to build, with the filter_init() error
+// and the highest frequency the chain could run at.
+void frame_init_error(uint16_t error, uint16_t *chain, uint16_t count)
+{
+	uint32_t max_frequency = filter_chain_max_frequency(filter_chain_cost(chain, count));
+	uint8_t reply[5] = { error, max_frequency, max_frequency >> 8, max_frequency >> 16, max_frequency >> 24 };
+	frame_reply(FRAME_STATUS_INIT, reply, 5);
+}
+
+// Multi-line exchanges of the plain protocol, in which the GUI asks for each line
+// of a reply, or sends each filter of a chain, with a command of its own. The main
+// loop keeps track of where it is in one rather than waiting for those commands, so
+// it stays free in between. Any other command ends the exchange and is handled as
+// usual. In the binary protocol all the lines are replies to the one request, so
+// they are sent at once and no exchange is left open.
+#define EXCHANGE_NONE 0
+#define EXCHANGE_DOWNLOAD 1 // Lines of the chain, exchange_index is the next filter.
+#define EXCHANGE_PROFILE 2 // Lines of the profile, exchange_element is the next filter.
+#define EXCHANGE_MEMORY 3 // Lines of the memory report, exchange_index is the next one.
+#define EXCHANGE_APPLY 4 // Filters of a new chain, exchange_index of them are staged.
+
+uint8_t exchange = EXCHANGE_NONE;
+uint16_t exchange_index;
+struct queue_element *exchange_element;
+uint16_t exchange_filter; // Index in filter_alloc_pool of the next filter of the memory report.
+
+// Send the next line of the multi-line reply under way, ending the exchange after
+// the last one.
+void exchange_line(char *s)
+{
+	if(exchange == EXCHANGE_DOWNLOAD) {
+		uint16_t i = exchange_index++;
+		sprintf(s, "Download:%c%c%c%c%c%c%c%c",
+						filters_buf[i*8 + 0]+32, //adding 32 because python is fussy with special characters
+						filters_buf[i*8 + 1]+32,
+						filters_buf[i*8 + 2]+32,
+						filters_buf[i*8 + 3]+32,
+						filters_buf[i*8 + 4]+32,
+						filters_buf[i*8 + 5]+32,
+						filters_buf[i*8 + 6]+32,
+						filters_buf[i*8 + 7]+32);
+		tty_writeln(s);
+
+		if(exchange_index >= filters_count) {
+			#if DEBUG==1
+			tty_writeln("Filter download done");
+			#endif
+			exchange = EXCHANGE_NONE;
+		}
+	}
+
+	#if PROFILE==1
+	if(exchange == EXCHANGE_PROFILE) {
+		struct filter *filter = exchange_element->value;
+		sprintf(s, "Profile:%d,%d,%d,%d", filter->filter_id,
+						(int) filter->profile.last,
+						(int) filter->profile.max,
+						(int) profile_mean(&filter->profile));
+		tty_writeln(s);
+
+		exchange_element = exchange_element->next;
+		if(exchange_element == NULL) {
+			// fold the measurements into the admission control cost model
+			filter_cost_calibrate();
+			exchange = EXCHANGE_NONE;
+		}
+	}
 	#endif
 
+	if(exchange == EXCHANGE_MEMORY) {
+		struct buf_pool *pools[2] = { &buf1, &buf2 };
+		uint16_t record = exchange_index++;
+
+		if(record < 4 && record % 2 == 0) {
+			struct buf_pool *pool = pools[record / 2];
+			sprintf(s, "Pool:%d,%d,%d,%d,%d", (int) pool->used,
+							(int) buf_pool_free_samples(pool),
+							(int) buf_pool_largest_free(pool),
+							(int) pool->used_max,
+							(int) buf_pool_fragmentation(pool));
+		} else if(record < 4) {
+			strcpy(s, "Map:");
+			buf_pool_map(pools[record / 2], &s[4], MEMORY_MAP_CELLS);
+		} else {
+			// skipping filters which were freed on their own
+			while(!filter_pool_live(&filter_alloc_pool[exchange_filter]))
+				exchange_filter++;
+			struct filter *filter = &filter_alloc_pool[exchange_filter++];
+			// memory taken and samples held, which differ for compact delay lines
+			sprintf(s, "Filter:%d,%d,%d", filter->filter_id, (int) filter_samples(filter),
+							filter->buf0_size + (filter->buf1 != NULL ? filter->buf1_size : 0));
+		}
+		tty_writeln(s);
+
+		if(exchange_index >= 4 + filter_alloc.live) {
+			exchange = EXCHANGE_NONE;
+		}
+	}
+}
+
+// Start a multi-line reply once its first line is sent. The binary protocol gets
+// the rest straight away, the plain one as the GUI asks for each line.
+void exchange_start(uint8_t kind, char *s)
+{
+	exchange = kind;
+	exchange_index = 0;
+	exchange_filter = 0;
+	exchange_element = q != NULL ? q->head : NULL;
+
+	// nothing to follow the first line
+	if((kind == EXCHANGE_DOWNLOAD && filters_count == 0) || (kind == EXCHANGE_PROFILE && exchange_element == NULL)) {
+		exchange = EXCHANGE_NONE;
+	}
+
+	while(serial_binary && exchange != EXCHANGE_NONE) {
+		exchange_line(s);
+	}
+}
+
+// Take a filter of a new chain, staged after the running one (see staged_chain).
+// The first filter is always the INPUT!
+/*
+	read_buffer[1] = filter_type
+	read_buffer[2] = unique_filter_id
+	read_buffer[3] = output_filter_id #1, 0 for none
+	read_buffer[4] = output_filter_id #2, 0 for none
+	read_buffer[5..8] = parameters 0 to 3
+*/
+void exchange_filter_command(char *read_buffer)
+{
+	// filters past FILTER_ALLOC_SIZE are counted, staged_admit() refuses the chain
+	int i;
+	for(i=0; i<8 && exchange_index < FILTER_ALLOC_SIZE; i++) {
+		staged_chain()[exchange_index*8 + i] = read_buffer[i+1];
+	}
+
+	exchange_index++;
+
+	tty_writeln("Filter");
+}
+
+// Replace the running chain with the one the apply exchange staged.
+void exchange_apply_end()
+{
+	uint16_t count = exchange_index;
+	uint16_t *chain = staged_chain();
+
+	exchange = EXCHANGE_NONE;
+
+	uint16_t error = staged_admit(count);
+	if(error == 0) {
+		// filters_buf holds the new chain from here on, whether it builds or not
+		error = staged_apply(count);
+		chain = filters_buf;
+	}
+	if(error == 0) {
+		tty_writeln("End filters");
+	} else {
+		write_init_error(error, chain, count);
+	}
+}
+
+// Carry on the exchange under way with a command of the plain protocol. Returns 1
+// if the command was part of it; any other ends the exchange and is handled as usual.
+uint8_t exchange_continue(char *read_buffer, char *s)
+{
+	if(exchange == EXCHANGE_APPLY && read_buffer[0] == REPL_FILTER_COMMAND) {
+		exchange_filter_command(read_buffer);
+		return 1;
+	}
+	if(exchange == EXCHANGE_APPLY && read_buffer[0] == REPL_APPLY_COMMAND) {
+		exchange_apply_end();
+		return 1;
+	}
+	if((exchange == EXCHANGE_DOWNLOAD && read_buffer[0] == REPL_DOWNLOAD_COMMAND) ||
+			(exchange == EXCHANGE_PROFILE && read_buffer[0] == REPL_PROFILE_COMMAND) ||
+			(exchange == EXCHANGE_MEMORY && read_buffer[0] == REPL_MEMORY_COMMAND)) {
+		exchange_line(s);
+		return 1;
+	}
+
+	// the command was unexpected, which probably means the interface or connection crashed
+	exchange = EXCHANGE_NONE;
+	return 0;
+}
+
+// Apply a whole filter chain sent in one binary frame, 8 bytes per filter laid out
+// as for the filter command, and acknowledge it once.
+void binary_apply(uint16_t length)
+{
+	uint16_t i;
+	uint16_t count = length / 8;
+	uint16_t *chain = staged_chain();
+
+	// a frame is never longer than FILTER_ALLOC_SIZE filters
+	for(i = 0; i < count*8; i++) {
+		chain[i] = frame_payload[i];
+	}
+
+	uint16_t error = staged_admit(count);
+	if(error == 0) {
+		// filters_buf holds the new chain from here on, whether it builds or not
+		error = staged_apply(count);
+		chain = filters_buf;
+	}
+	if(error == 0) {
+		frame_reply(FRAME_STATUS_OK, NULL, 0);
+	} else {
+		frame_init_error(error, chain, count);
+	}
+}
+
+// Send the current filter chain in one binary frame, 8 bytes per filter.
+void binary_download()
+{
+	uint16_t i;
+
+	frame_begin(FRAME_STATUS_OK, filters_count*8);
+	for(i = 0; i < filters_count*8; i++) {
+		uint8_t value = filters_buf[i];
+		frame_put(&value, 1);
+	}
+	frame_end();
+}
+
+// Send the captured samples which are ready in one binary frame: the capture state,
+// the overruns (2 bytes) and the samples (2 bytes each), all little endian.
+void binary_scope()
+{
+	uint16_t i, samples[CAPTURE_LINE_SAMPLES];
+	uint16_t n = capture_available();
+	if(n > (FRAME_MAX_PAYLOAD - 3) / 2) {
+		n = (FRAME_MAX_PAYLOAD - 3) / 2;
+	}
+
+	// the interrupt only adds samples, so n of them can be read in pieces
+	uint8_t header[3] = { capture.state, capture.overruns, capture.overruns >> 8 };
+	frame_begin(FRAME_STATUS_OK, 3 + n*2);
+	frame_put(header, 3);
+	while(n > 0) {
+		uint16_t count = capture_read(samples, n < CAPTURE_LINE_SAMPLES ? n : CAPTURE_LINE_SAMPLES);
+		for(i = 0; i < count; i++) {
+			uint8_t value[2] = { samples[i], samples[i] >> 8 };
+			frame_put(value, 2);
+		}
+		n -= count;
+	}
+	frame_end();
+}
+
+void main(void)
+{
+	char read_buffer[16];
+	char s[64];
+
+	// started first, as it also times how long audio takes to come up (boot_cycles)
+	profile_init();
+
+	// Audio comes up before serial: the chain which was running at power off is
+	// restored straight from the preset log, the GUI can connect later on.
+	dac_init();
+	adc_init();
+	timer_init(frequency);
 	alloc_init();
-	#if DEBUG==1
-	tty_writeln("Alloc Init");
-	#endif
+	preset_init();
 
 	//scramble_init();
 	//tty_writeln("Scramble Init");
@@ -194,17 +546,69 @@ void main(void)
 	#if DEBUG==1
 		do_debug();
 	#else
-		do_passthrough();
+		if(do_restore() != 0) {
+			do_passthrough();
+		}
 	#endif
 
+	serial_init();
 	#if DEBUG==1
+	tty_writeln("Serial Init");
 	tty_writeln("Passthrough Init");
 	#endif
 
+	// Commands are assembled by the serial interrupt and the parsers in serial.c as
+	// bytes arrive. Until one is complete the main loop is free, and sleeps until the
+	// next interrupt as there is no background work yet.
 	while(1)  {
-		if(!skip_reading)
-			tty_read_blocking(read_buffer, 16);
-		skip_reading = 0;
+		if(serial_binary) {
+			uint16_t length;
+			uint8_t status;
+			if(!frame_poll(&length, &status)) {
+				__WFI();
+				continue;
+			}
+			if(status != FRAME_STATUS_OK) {
+				frame_reply(status, NULL, 0);
+				continue;
+			}
+			if(frame_command == 0 || strchr(REPL_COMMANDS, frame_command) == NULL) {
+				frame_reply(FRAME_STATUS_COMMAND, NULL, 0);
+				continue;
+			}
+
+			// the chain travels in a single frame rather than a request per filter
+			if(frame_command == REPL_APPLY_COMMAND) {
+				binary_apply(length);
+				continue;
+			}
+			if(frame_command == REPL_DOWNLOAD_COMMAND) {
+				binary_download();
+				continue;
+			}
+			if(frame_command == REPL_SCOPE_COMMAND) {
+				binary_scope();
+				continue;
+			}
+
+			// other commands take their arguments from read_buffer as in the plain protocol
+			memset(read_buffer, 0, 16);
+			read_buffer[0] = frame_command;
+			memcpy(&read_buffer[1], frame_payload, length < 15 ? length : 15);
+		} else {
+			if(!command_poll(read_buffer)) {
+				__WFI();
+				continue;
+			}
+
+			// exchanges are only left open in the plain protocol, which has no final frame
+			if(exchange != EXCHANGE_NONE && exchange_continue(read_buffer, s)) {
+				continue;
+			}
+		}
+
+		// final status of the request in the binary protocol, set by commands which fail
+		uint8_t status = FRAME_STATUS_OK;
 
 		#if DEBUG==1 && TRACE==1
 		tty_writeln("While");
@@ -237,109 +641,214 @@ void main(void)
 			sprintf(s, "Download:%d", filters_count);
 			tty_writeln(s);
 
-			int i=0;
-			while(i < filters_count){
-				tty_read_blocking(read_buffer, 16);
-				if(read_buffer[0] == REPL_DOWNLOAD_COMMAND) {
-					sprintf(s, "Download:%c%c%c%c%c%c%c%c",
-									filters_buf[i*8 + 0]+32, //adding 32 because python is fussy with special characters
-									filters_buf[i*8 + 1]+32,
-									filters_buf[i*8 + 2]+32,
-									filters_buf[i*8 + 3]+32,
-									filters_buf[i*8 + 4]+32,
-									filters_buf[i*8 + 5]+32,
-									filters_buf[i*8 + 6]+32,
-									filters_buf[i*8 + 7]+32);
+			exchange_start(EXCHANGE_DOWNLOAD, s);
+		}
 
-					tty_writeln(s);
+		// Upload cycle counts of the running filter chain to GUI
+		if(read_buffer[0] == REPL_PROFILE_COMMAND) {
+			#if PROFILE==1
+			// walk the queue without touching q->current, which belongs to filter_loop
+			// filters that aren't reachable from the input are never queued, so count
+			// the queue rather than using filters_count
+			struct queue_element *element;
+			int queued = 0;
+			// no chain is built after a failed apply or load, so there are no filters
+			for(element = q != NULL ? q->head : NULL; element != NULL; element = element->next)
+				queued++;
+
+			// first line is the whole interrupt, followed by one line per filter
+			// in execution order, each requested by the GUI like the download command
+			// the interrupt line also has the time from reset to the first sample in us
+			sprintf(s, "Profile:%d,%d,%d,%d,%d", queued,
+							(int) isr_profile.last,
+							(int) isr_profile.max,
+							(int) profile_mean(&isr_profile),
+							(int) (boot_cycles / (SystemCoreClock / 1000000)));
+			tty_writeln(s);
 
-					if(i == filters_count-1) {
-						#if DEBUG==1
-						tty_writeln("Filter download done");
-						#endif
+			// the measurements are folded into the admission control cost model
+			// after the last filter
+			exchange_start(EXCHANGE_PROFILE, s);
+			#else
+			tty_writeln("Profile:0,0,0,0");
+			#endif
+		}
 
-						break;
-					}
+		// Report overruns of the timer interrupt since the chain was started
+		if(read_buffer[0] == REPL_XRUN_COMMAND) {
+			sprintf(s, "Xrun:%d,%d,%d,%d", (int) xrun_count,
+							(int) xrun_missed,
+							(int) xrun_late_max,
+							xrun_bypass);
+			tty_writeln(s);
+		}
+
+		// Set how many consecutive overruns make the chain fall back to bypass, 0 disables it
+		if(read_buffer[0] == REPL_BYPASS_COMMAND) {
+			xrun_bypass_limit = read_buffer[1];
+			tty_writeln("Bypass");
+		}
+
+		// Change a parameter of the running chain without rebuilding it
+		// (int)read_buffer[1] is the filter id, read_buffer[2] the parameter (0-3) and read_buffer[3] its value
+		if(read_buffer[0] == REPL_UPDATE_COMMAND) {
+			if(filter_update((uint8_t) read_buffer[1], (uint8_t) read_buffer[2], (uint8_t) read_buffer[3]) == 0) {
+				tty_writeln("Update");
+			} else {
+				tty_writeln("Error Update");
+				status = FRAME_STATUS_ERROR;
+			}
+		}
+
+		// Tap the output of a filter into the capture ring, or stop capturing
+		// (int)read_buffer[1] is the filter id, read_buffer[2] the trigger (CAPTURE_*, anything else stops),
+		// read_buffer[3] the level (0-NUMBER_OF_STEPS), read_buffer[4] the pre-trigger depth in percent
+		// of CAPTURE_LENGTH and read_buffer[5] the decimation
+		if(read_buffer[0] == REPL_CAPTURE_COMMAND) {
+			uint8_t trigger = read_buffer[2];
+			if(trigger > CAPTURE_FREE) {
+				capture_stop();
+				tty_writeln("Capture");
+			} else if(capture_start(filter_find((uint8_t) read_buffer[1]), trigger,
+							((uint8_t) read_buffer[3])*ADC_STEP,
+							(((uint8_t) read_buffer[4])*CAPTURE_LENGTH)/100,
+							(uint8_t) read_buffer[5]) == 0) {
+				tty_writeln("Capture");
+			} else {
+				tty_writeln("Error Capture");
+				status = FRAME_STATUS_ERROR;
+			}
+		}
+
+		// Send the captured samples which are ready, at most CAPTURE_LINE_SAMPLES of them
+		// at a time. The GUI polls this while the scope is open.
+		if(read_buffer[0] == REPL_SCOPE_COMMAND) {
+			uint16_t i, samples[CAPTURE_LINE_SAMPLES];
+			uint16_t n = capture_read(samples, CAPTURE_LINE_SAMPLES);
+			int length = sprintf(s, "Scope:%d,%d", capture.state, capture.overruns);
+			for(i = 0; i < n; i++) {
+				length += sprintf(&s[length], ",%d", samples[i]);
+			}
+			tty_writeln(s);
+		}
+
+		// Report memory usage: struct pools, then each sample pool and its map, then
+		// the samples allocated to each filter
+		if(read_buffer[0] == REPL_MEMORY_COMMAND) {
+			// the chain's filters are the live entries below the top of the pool
+			sprintf(s, "Memory:%d,%d,%d,%d,%d", (int) filter_alloc.live,
+							(int) filter_alloc.live_max,
+							(int) queue_element_alloc.live,
+							(int) queue_element_alloc.live_max,
+							(int) alloc_errors);
+			tty_writeln(s);
+
+			// each further line is requested by the GUI like the download command
+			exchange_start(EXCHANGE_MEMORY, s);
+		}
+
+		// Switch protocol: read_buffer[1] is the version, 0 for the plain one, followed by
+		// the baud rate to continue at in ASCII digits, 0 terminated. The reply still
+		// goes out in the old protocol and at the old rate.
+		if(read_buffer[0] == REPL_VERSION_COMMAND) {
+			uint8_t version = read_buffer[1];
+			int index = 2;
+			uint32_t baud = 0;
+
+			while(index < 16 && read_buffer[index] != 0) {
+				baud = baud*10+(read_buffer[index]-'0');
+				index++;
+			}
+
+			if(version > PROTOCOL_VERSION || baud < 1200 || baud > 1000000) {
+				tty_writeln("Error");
+				status = FRAME_STATUS_ERROR;
+			} else {
+				sprintf(s, "Version:%d", version);
+				if(serial_binary) {
+					frame_reply(FRAME_STATUS_OK, (uint8_t *)s, strlen(s));
 				} else {
-					skip_reading = 1; //the command was invalid, which probably means the interface or connection crashed
-					break;
+					tty_writeln(s);
 				}
 
-
-				i++;
+				serial_set_baud(baud);
+				serial_binary = version;
+				continue;
 			}
 		}
 
 		// Load a filter chain from the flash memory, initialise and run it
 		if(read_buffer[0] == REPL_LOAD_COMMAND) {
 			uint8_t block = read_buffer[1];
+
+			// looked up in the preset index (see preset.c)
+			uint16_t fc = block > 9 ? 0 : preset_count(block);
+
 			if(block > 9){ //10 blocks available to load from
 				#if DEBUG==1
 				tty_writeln("ERROR: Requested block does not exist");
 				#else
 				tty_writeln("ERROR");
 				#endif
-
-				break;
-			}
-
-			// store so we can recover in case of failure of retrieval
-			uint16_t fc = filters_count;
-
-			get_filter_chain_size(&filters_count, block);
-
-
-			if(filters_count == 0){
+				status = FRAME_STATUS_ERROR;
+			}else if(fc == 0){
 				#if DEBUG==1
 				tty_writeln("Requested block is empty");
 				#else
 				tty_writeln("Block empty");
 				#endif
-
-				filters_count = fc;
+				status = FRAME_STATUS_ERROR;
 			}else{
-				timer_stop();
-
-				// copy filters_count here as it is wiped by free_all_filters()
-				fc = filters_count;
-
-				free_all_filters();
-				free_all_buf();
-
-				// reset filters_count to what it was before
-				filters_count = fc;
-
-				flash_to_filter_chain(filters_buf, filters_count, block);
-
-				filter_init(filters_buf, filters_count);
+				// checked before the running chain is stopped, which plays on if it's refused
+				uint16_t *chain = staged_chain();
+				preset_load(block, chain);
+				uint16_t error = staged_admit(fc);
+				if(error == 0) {
+					timer_stop();
+
+					free_all();
+
+					// built from its compiled plan if it has one, into filters_buf
+					error = preset_build(block);
+					chain = filters_buf;
+					if(error == 0) {
+						remember_chain();
 
-				timer_start();
+						timer_start();
+					}
+				}
 
-				tty_writeln("Loaded");
+				if(error == 0) {
+					tty_writeln("Loaded");
+				} else {
+					write_init_error(error, chain, fc);
+					if(serial_binary) {
+						frame_init_error(error, chain, fc);
+						continue;
+					}
+				}
 			}
 		}
 
-		// Save a filter chain to flash
-		// Can only save to each block once due to flash sectors not erasing
+		// Save a filter chain to flash, appending it to the preset log
 		if(read_buffer[0] == REPL_SAVE_COMMAND) {
 			uint8_t block = read_buffer[1];
 
-			if(block > 9){ //10 blocks available to load from
+			//Save into requested block
+			if(block > 9){ //10 blocks available to save to
 				#if DEBUG==1
 				tty_writeln("ERROR: Requested block does not exist");
 				#else
 				tty_writeln("ERROR");
 				#endif
-
-				break;
-			}
-			//Save into requested block
-			if(filter_chain_to_flash(filters_buf, &filters_count, block) != 0){
+				status = FRAME_STATUS_ERROR;
+			} else if(preset_save(block, filters_buf, filters_count, frequency) != 0){
 				#if DEBUG==1
-				tty_writeln("ERROR: Block has already been written to");
+				tty_writeln("ERROR: Flash write failed");
 				#else
 				tty_writeln("Error");
 				#endif
+				status = FRAME_STATUS_ERROR;
 			} else {
 				tty_writeln("Saved");
 			}
@@ -348,81 +857,47 @@ void main(void)
 		if(read_buffer[0] == REPL_SET_COMMAND) {
 			// command that gets the frequency from CLI and sets
 			int index = 1;
-			frequency = 0;
+			uint32_t requested = 0;
 
 			while(read_buffer[index] != 0) { //if not EOL
-				frequency = frequency*10+(read_buffer[index]-'0');
+				requested = requested*10+(read_buffer[index]-'0');
 
 				index++;
 			}
 
-			timer_stop(); //@TODO test if it is really needed
-			timer_init(frequency);
-			timer_start(); //@TODO test if it is really needed
-
-			tty_writeln("Set");
-		}
-
-		if(read_buffer[0] == REPL_APPLY_COMMAND) {
-			// command that gets a filter chain from CLI and applies it
-			timer_stop();
-
-			free_all_filters();
-			free_all_buf();
-
-			tty_writeln("Apply");
-
-			filters_count = 0;
+			// refuse rates the running chain can't keep up with, proposing the highest one it can
+			uint32_t max_frequency = filter_chain_max_frequency(filter_chain_cost(filters_buf, filters_count));
+			if(requested > max_frequency) {
+				sprintf(s, "Error Max:%d", (int) max_frequency);
+				tty_writeln(s);
+				status = FRAME_STATUS_ERROR;
+			} else {
+				frequency = requested;
 
-			while(1) {
-				tty_read_blocking(read_buffer, 16);
+				timer_stop(); //@TODO test if it is really needed
+				timer_init(frequency);
 
-				if(read_buffer[0]== REPL_APPLY_COMMAND) {
-					uint16_t error =  filter_init(filters_buf, filters_count);
-					if(error == 0) {
-						timer_start();
+				remember_chain();
 
-						tty_writeln("End filters");
-					} else {
-						sprintf(s, "Error: %d", error);
+				timer_start(); //@TODO test if it is really needed
 
-						tty_writeln(s);
-					}
+				tty_writeln("Set");
+			}
+		}
 
-					break;
-				} else if(read_buffer[0]== REPL_FILTER_COMMAND) {
-					// the first filter is always the INPUT!
-
-					// (int)read_buffer[1] is filter function index
-					// (int)read_buffer[2] filter id (unique) - 1
-					// (int)read_buffer[3,4] filter ids to output to, it is limited to 2 for simplicity - 2,3
-					// each of the following bytes can be a parameter (the gui takes 4 values of 0-254 !!! 254, not 255!!! comma sepparated)
-					// next_id of 0x00 implies there is no next filter - filter->next = NULL (next filter is set to the input filter, which is obviously not taking any buffer input)
-
-					/*
-						filters_buf[n*8 + 0] = filter_type
-						filters_buf[n*8 + 1] = unique_filter_id
-						filters_buf[n*8 + 2] = output_filter_id #1
-						filters_buf[n*8 + 3] = output_filter_id #2
-						filters_buf[n*8 + 4] = parameter 0
-						filters_buf[n*8 + 5] = parameter 1
-						filters_buf[n*8 + 6] = parameter 2
-						filters_buf[n*8 + 7] = parameter 3
-					*/
-
-					int i;
-					for(i=0; i<8; i++) {
-						filters_buf[filters_count*8 + i] = read_buffer[i+1];
-					}
+		if(read_buffer[0] == REPL_APPLY_COMMAND) {
+			// command that gets a filter chain from CLI and applies it, one filter
+			// command at a time, the next apply command ends it
+			// the running chain plays on while the new one is staged after it
+			exchange = EXCHANGE_APPLY;
+			exchange_index = 0;
 
-					filters_count++;
+			tty_writeln("Apply");
+		}
 
-					tty_writeln("Filter");
-				} else {
-					skip_reading = 1; //the command was invalid, which probably means, the interface or connection crashed
-					break;
-				}
-			}
+		// the lines above were all sent as intermediate replies, finish the request
+		if(serial_binary) {
+			frame_reply(status, NULL, 0);
 		}
 	}
 
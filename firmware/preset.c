@@ -0,0 +1,405 @@
+// Presets are kept in flash as a log: each save appends a record to the sector
+// being written, and the latest record of a slot is its preset. An index of those
+// in RAM, built at boot, makes loads O(1). When the sector fills up, records go on
+// in the spare sector after it, and the oldest sector, the one after that, is
+// emptied: its records which are still the latest of their slot are copied over,
+// then it is erased to become the next spare. The sectors are used in turn, so they
+// wear evenly, and saves are unlimited.
+//
+// Only whole pages are ever written, each once between erases. A save cut short by
+// a reset leaves a record with a bad CRC, which ends the sector as far as the scan
+// at boot is concerned; the previous record of the slot is still there.
+
+#ifndef _HAPR_PRESET
+#define _HAPR_PRESET
+
+#include "LPC17xx.h"
+#include "string.h"
+
+#include "filter_chain.h"
+#include "iap.h"
+#include "preset.h"
+#include "serial.h"
+#include "timer.h"
+
+// Is a sector an erased spare, waiting to be appended to?
+#define PRESET_SPARE(n) (((struct preset_sector *)PRESET_SECTOR_ADDRESS(n))->magic == PRESET_SECTOR_MAGIC && \
+	((struct preset_sector *)PRESET_SECTOR_ADDRESS(n))->sequence == PRESET_ERASED)
+
+// Program preset_page to a page of the log. Interrupts are held off meanwhile, as
+// flash can't be read while it is programmed and the interrupt vectors are in it.
+uint16_t preset_program(uint8_t *address)
+{
+	uint16_t sector = PRESET_FIRST_SECTOR + (address - PRESET_SECTOR_ADDRESS(0)) / PRESET_SECTOR_SIZE;
+
+	__disable_irq();
+	prepare_sector_write(sector, sector);
+	if (output[0] == CMD_SUCCESS) {
+		copy_ram_flash((uint16_t *)preset_page, (uint16_t *)address, PRESET_PAGE_SIZE);
+	}
+	__enable_irq();
+	if (output[0] != CMD_SUCCESS) {
+		write_error(output[0]);
+		return output[0];
+	}
+
+	compare_flash_ram((uint16_t *)preset_page, (uint16_t *)address, PRESET_PAGE_SIZE);
+	if (output[0] != CMD_SUCCESS) {
+		write_error(output[0]);
+		return output[0];
+	}
+	return 0;
+}
+
+// Erase a sector of the log and make it a spare, keeping its erase count.
+uint16_t preset_erase(uint16_t n)
+{
+	uint16_t sector = PRESET_FIRST_SECTOR + n;
+
+	__disable_irq();
+	prepare_sector_write(sector, sector);
+	if (output[0] == CMD_SUCCESS) {
+		erase_sector(sector, sector);
+	}
+	__enable_irq();
+	if (output[0] != CMD_SUCCESS) {
+		write_error(output[0]);
+		return output[0];
+	}
+
+	preset_erases[n]++;
+	preset_sequence[n] = 0;
+
+	memset(preset_page, 0xFF, PRESET_PAGE_SIZE);
+	preset_page[0] = PRESET_SECTOR_MAGIC;
+	preset_page[1] = preset_erases[n];
+	return preset_program(PRESET_SECTOR_ADDRESS(n));
+}
+
+// Start appending to a spare sector.
+uint16_t preset_activate(uint16_t n)
+{
+	uint32_t sequence = preset_sequence[preset_active] + 1;
+
+	memset(preset_page, 0xFF, PRESET_PAGE_SIZE);
+	preset_page[0] = sequence;
+	uint16_t error = preset_program(PRESET_SECTOR_ADDRESS(n) + PRESET_PAGE_SIZE);
+	if (error) {
+		return error;
+	}
+
+	preset_sequence[n] = sequence;
+	preset_active = n;
+	preset_head = PRESET_FIRST_RECORD;
+	return 0;
+}
+
+// Program the page being filled at the head of the active sector, padded with
+// erased bytes.
+uint16_t preset_flush()
+{
+	if (preset_fill == 0) {
+		return 0;
+	}
+	memset((uint8_t *)preset_page + preset_fill, 0xFF, PRESET_PAGE_SIZE - preset_fill);
+	preset_fill = 0;
+
+	uint16_t error = preset_program(PRESET_SECTOR_ADDRESS(preset_active) + preset_head);
+	preset_head += PRESET_PAGE_SIZE;
+	return error;
+}
+
+// Add bytes to the record being written at the head of the active sector.
+uint16_t preset_put(uint8_t *bytes, uint32_t length)
+{
+	uint16_t error = 0;
+	while (length-- > 0 && !error) {
+		((uint8_t *)preset_page)[preset_fill++] = *bytes++;
+		if (preset_fill == PRESET_PAGE_SIZE) {
+			error = preset_flush();
+		}
+	}
+	return error;
+}
+
+// Check a record is whole: the scan at boot stops at anything else.
+uint8_t preset_valid(struct preset_record *record, uint8_t *end)
+{
+	if (record->magic != PRESET_RECORD_MAGIC || record->slot >= PRESET_SLOTS ||
+			(uint8_t *)record + PRESET_RECORD_SIZE(PRESET_DATA_LENGTH(record)) > end) {
+		return 0;
+	}
+	return crc16(0xFFFF, &record->slot, sizeof(struct preset_record) - 4 + PRESET_DATA_LENGTH(record)) == record->crc;
+}
+
+// Index the records of a sector. Returns the offset after the last one, or the end
+// of the sector if a damaged record cuts it short.
+uint32_t preset_scan(uint16_t n)
+{
+	uint8_t *base = PRESET_SECTOR_ADDRESS(n);
+	uint32_t offset = PRESET_FIRST_RECORD;
+
+	while (offset < PRESET_SECTOR_SIZE) {
+		struct preset_record *record = (struct preset_record *)(base + offset);
+		if (record->magic == (uint16_t)PRESET_ERASED) {
+			break;
+		}
+		if (!preset_valid(record, base + PRESET_SECTOR_SIZE)) {
+			return PRESET_SECTOR_SIZE;
+		}
+
+		if (preset_index[record->slot] == NULL || record->version >= preset_index[record->slot]->version) {
+			preset_index[record->slot] = record;
+		}
+		if (record->version > preset_version) {
+			preset_version = record->version;
+		}
+		offset += PRESET_RECORD_SIZE(PRESET_DATA_LENGTH(record));
+	}
+	return offset;
+}
+
+// Empty the sector after the active one, which is the oldest, into the active one
+// and erase it. Does nothing if it already is a spare.
+uint16_t preset_reclaim()
+{
+	uint16_t victim = (preset_active + 1) % PRESET_SECTORS;
+	uint8_t *base = PRESET_SECTOR_ADDRESS(victim);
+	uint16_t slot, error;
+
+	if (PRESET_SPARE(victim)) {
+		return 0;
+	}
+
+	for (slot = 0; slot < PRESET_SLOTS; slot++) {
+		struct preset_record *record = preset_index[slot];
+		if ((uint8_t *)record < base || (uint8_t *)record >= base + PRESET_SECTOR_SIZE) {
+			continue;
+		}
+
+		// copied as it is, version and all
+		uint32_t size = PRESET_RECORD_SIZE(PRESET_DATA_LENGTH(record));
+		if (preset_head + size > PRESET_SECTOR_SIZE) {
+			return PRESET_ERROR_FULL;
+		}
+		struct preset_record *copy = (struct preset_record *)(PRESET_SECTOR_ADDRESS(preset_active) + preset_head);
+		error = preset_put((uint8_t *)record, size);
+		if (error) {
+			return error;
+		}
+		preset_index[slot] = copy;
+	}
+
+	return preset_erase(victim);
+}
+
+// Start the log on flash which has never held it: make every sector a spare, start
+// appending to the first and import the presets saved in the old fixed blocks.
+void preset_format()
+{
+	uint16_t n, count;
+
+	for (n = 0; n < PRESET_SECTORS; n++) {
+		preset_erase(n);
+	}
+	preset_active = 0;
+	preset_activate(0);
+
+	for (n = 0; n < PRESET_BLOCKS; n++) {
+		get_filter_chain_size(&count, n);
+		if (count > 0 && count <= FILTER_ALLOC_SIZE) {
+			flash_to_filter_chain(filters_buf, count, n);
+			preset_save(n, filters_buf, count, frequency);
+		}
+	}
+}
+
+// Build the index of the log, formatting it if there is none.
+void preset_init()
+{
+	uint16_t n;
+	uint8_t found = 0;
+
+	for (n = 0; n < PRESET_SECTORS; n++) {
+		struct preset_sector *sector = (struct preset_sector *)PRESET_SECTOR_ADDRESS(n);
+		preset_erases[n] = sector->magic == PRESET_SECTOR_MAGIC ? sector->erases : 0;
+		preset_sequence[n] = sector->magic == PRESET_SECTOR_MAGIC && sector->sequence != PRESET_ERASED ? sector->sequence : 0;
+		if (preset_sequence[n] != 0 && (!found || preset_sequence[n] > preset_sequence[preset_active])) {
+			preset_active = n;
+			found = 1;
+		}
+	}
+	if (!found) {
+		preset_format();
+		return;
+	}
+
+	// oldest first, so equal versions left behind by an interrupted reclaim resolve
+	// to the copy in the newer sector
+	for (n = 1; n <= PRESET_SECTORS; n++) {
+		uint16_t sector = (preset_active + n) % PRESET_SECTORS;
+		if (preset_sequence[sector] != 0) {
+			uint32_t end = preset_scan(sector);
+			if (sector == preset_active) {
+				preset_head = end;
+			}
+		}
+	}
+
+	// a save may have been cut short between moving to a new sector and erasing the
+	// oldest one
+	preset_reclaim();
+}
+
+// Fold bytes of a plan into preset_crc, for filter_plan_write().
+uint16_t preset_plan_crc(uint8_t *bytes, uint32_t length)
+{
+	preset_crc = crc16(preset_crc, bytes, length);
+	return 0;
+}
+
+// Save a filter chain and the sample rate it runs at to a slot. If a chain was
+// built, which is then the one in filters_buf, its compiled plan goes with it.
+uint16_t preset_save(uint8_t slot, uint16_t *filters_buf, uint16_t filters_count, uint32_t frequency)
+{
+	struct preset_record header;
+	uint16_t i, error = 0;
+	uint32_t length = filters_count * 8;
+	uint32_t plan_length = filter_plan_length();
+
+	if (slot >= PRESET_SLOTS || filters_count > FILTER_ALLOC_SIZE) {
+		return PRESET_ERROR_SLOT;
+	}
+
+	if (preset_head + PRESET_RECORD_SIZE(length + plan_length) > PRESET_SECTOR_SIZE) {
+		error = preset_activate((preset_active + 1) % PRESET_SECTORS);
+		if (!error) {
+			error = preset_reclaim();
+		}
+		if (error) {
+			return error;
+		}
+	}
+
+	header.magic = PRESET_RECORD_MAGIC;
+	header.slot = slot;
+	header.plan = plan_length ? (plan_length - sizeof(struct plan)) / sizeof(struct plan_filter) : PRESET_NO_PLAN;
+	header.length = length;
+	header.version = preset_version + 1;
+	header.frequency = frequency;
+	preset_crc = crc16(0xFFFF, &header.slot, sizeof(struct preset_record) - 4);
+	for (i = 0; i < length; i++) {
+		uint8_t value = filters_buf[i];
+		preset_crc = crc16(preset_crc, &value, 1);
+	}
+	// the plan is compiled twice, once for the CRC in the header before it
+	if (plan_length) {
+		filter_plan_write(preset_plan_crc);
+	}
+	header.crc = preset_crc;
+
+	struct preset_record *record = (struct preset_record *)(PRESET_SECTOR_ADDRESS(preset_active) + preset_head);
+	error = preset_put((uint8_t *)&header, sizeof(struct preset_record));
+	for (i = 0; i < length && !error; i++) {
+		uint8_t value = filters_buf[i];
+		error = preset_put(&value, 1);
+	}
+	if (plan_length && !error) {
+		error = filter_plan_write(preset_put);
+	}
+	if (!error) {
+		error = preset_flush();
+	}
+	// the scan at boot stops at a failed record, so nothing more goes in this sector
+	preset_fill = 0;
+	if (error) {
+		preset_head = PRESET_SECTOR_SIZE;
+		return error;
+	}
+
+	preset_version = header.version;
+	preset_index[slot] = record;
+	return 0;
+}
+
+// Does a slot already hold this chain and sample rate? Saves which would change
+// nothing can be skipped, sparing the flash.
+uint8_t preset_equal(uint8_t slot, uint16_t *filters_buf, uint16_t filters_count, uint32_t frequency)
+{
+	uint16_t i;
+	struct preset_record *record = preset_index[slot];
+
+	if (record == NULL || record->length != filters_count * 8 || record->frequency != frequency) {
+		return 0;
+	}
+	uint8_t *data = (uint8_t *)(record + 1);
+	for (i = 0; i < record->length; i++) {
+		if (data[i] != filters_buf[i]) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+// Filters in the preset of a slot, 0 if it is empty.
+uint16_t preset_count(uint8_t slot)
+{
+	if (slot >= PRESET_SLOTS || preset_index[slot] == NULL) {
+		return 0;
+	}
+	return preset_index[slot]->length / 8;
+}
+
+// Sample rate saved with the preset of a slot, which must not be empty.
+uint32_t preset_frequency(uint8_t slot)
+{
+	return preset_index[slot]->frequency;
+}
+
+// Copy the preset of a slot into filters_buf.
+void preset_load(uint8_t slot, uint16_t *filters_buf)
+{
+	uint16_t i, length = preset_index[slot]->length;
+	uint8_t *data = (uint8_t *)(preset_index[slot] + 1);
+
+	for (i = 0; i < length; i++) {
+		filters_buf[i] = data[i];
+	}
+}
+
+// Compiled plan saved with the preset of a slot, where it lies in flash. NULL if
+// the slot is empty, there is no plan or it was made by a different firmware.
+struct plan *preset_plan(uint8_t slot)
+{
+	struct preset_record *record = preset_index[slot];
+
+	if (record == NULL || record->plan == PRESET_NO_PLAN) {
+		return NULL;
+	}
+	struct plan *plan = (struct plan *)((uint8_t *)(record + 1) + record->length);
+	if (plan->magic != PLAN_MAGIC || plan->version != PLAN_VERSION || plan->count != record->plan) {
+		return NULL;
+	}
+	return plan;
+}
+
+// Load the preset of a slot into filters_buf and build its chain, from the plan
+// saved with it if it has one. Returns the errors of filter_init().
+uint16_t preset_build(uint8_t slot)
+{
+	struct plan *plan = preset_plan(slot);
+
+	// filters_buf is kept as the chain running, for the download and update commands
+	filters_count = preset_count(slot);
+	preset_load(slot, filters_buf);
+
+	if (plan != NULL) {
+		uint16_t error = filter_plan_load(plan);
+		if (error != 7) {
+			return error;
+		}
+	}
+	return filter_init(filters_buf, filters_count);
+}
+
+#endif
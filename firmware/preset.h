@@ -0,0 +1,79 @@
+#ifndef _HAPR_PRESET_H
+#define _HAPR_PRESET_H
+
+// The preset log spans these 32 kB flash sectors. The fixed blocks used before it
+// live in sectors 27 and 29 and are imported when the log is first formatted.
+#define PRESET_FIRST_SECTOR 22
+#define PRESET_SECTORS 4
+#define PRESET_SECTOR_SIZE 32768
+#define PRESET_PAGE_SIZE 256 // Smallest flash write, records start on a page.
+#define PRESET_SLOTS 11 // Presets which can be saved: blocks 0-9 of the load and save commands, and PRESET_LAST.
+#define PRESET_BLOCKS 10 // Slots the load and save commands can use.
+#define PRESET_LAST PRESET_BLOCKS // Slot of the chain last run, restored at boot.
+#define PRESET_SECTOR_MAGIC 0x4C504148 // "HAPL", first word of a sector which is part of the log.
+#define PRESET_RECORD_MAGIC 0x5052 // "PR", first half word of a record.
+#define PRESET_ERASED 0xFFFFFFFF // Word of erased flash.
+#define PRESET_NO_PLAN 0xFF // plan of a record saved without one.
+
+// Errors of preset_save() besides the IAP return codes (see iap.c).
+#define PRESET_ERROR_SLOT 0x100 // No such slot, or a chain too long for a record.
+#define PRESET_ERROR_FULL 0x101 // Live presets didn't fit the next sector, which can't happen with PRESET_SLOTS of them.
+
+// Every sector starts with two pages. The first is written with the magic and the
+// erase count as soon as the sector is erased, the second with the sequence number
+// when the sector becomes the one being appended to. Until then it is a spare.
+struct preset_sector
+{
+	uint32_t magic; // PRESET_SECTOR_MAGIC.
+	uint32_t erases; // Times the sector has been erased, for wear levelling.
+	uint8_t reserved[PRESET_PAGE_SIZE - 8];
+	uint32_t sequence; // Order the sectors were appended to in, PRESET_ERASED while a spare.
+};
+
+// Header of a record, which is followed by length bytes of filter chain, 8 per filter
+// laid out as in filters_buf, then the compiled plan of the chain if it was running
+// when saved (see filter_plan_load). The CRC covers everything after crc. The sample
+// rate is only put back for PRESET_LAST, loading a preset keeps the current one.
+// Records written before plans have 0xFF in place of plan.
+struct preset_record
+{
+	uint16_t magic; // PRESET_RECORD_MAGIC, erased flash if there are no more records.
+	uint16_t crc; // CRC-16/CCITT (see serial.c).
+	uint8_t slot; // Slot saved to.
+	uint8_t plan; // Filters in the plan after the chain, PRESET_NO_PLAN if there is none.
+	uint16_t length; // Bytes of filter chain.
+	uint32_t version; // Saves so far, the latest record of a slot is its preset.
+	uint32_t frequency; // Sample rate the chain was running at.
+};
+
+// Bytes of a plan of count filters.
+#define PRESET_PLAN_LENGTH(count) ((count) == PRESET_NO_PLAN ? 0 : sizeof(struct plan) + (count) * sizeof(struct plan_filter))
+// Bytes after the header of a record, its chain and plan.
+#define PRESET_DATA_LENGTH(record) ((record)->length + PRESET_PLAN_LENGTH((record)->plan))
+// Bytes taken by a record holding data of the given length.
+#define PRESET_RECORD_SIZE(length) ((sizeof(struct preset_record) + (length) + PRESET_PAGE_SIZE - 1) & ~(PRESET_PAGE_SIZE - 1))
+// Flash address of a sector of the log.
+#define PRESET_SECTOR_ADDRESS(n) ((uint8_t *)0x00010000 + ((PRESET_FIRST_SECTOR + (n) - 16) << 15))
+// First record of a sector, after the two header pages.
+#define PRESET_FIRST_RECORD (2 * PRESET_PAGE_SIZE)
+
+struct preset_record *preset_index[PRESET_SLOTS]; // Latest record of each slot, NULL if it was never saved.
+uint32_t preset_sequence[PRESET_SECTORS]; // Sequence number of each sector, 0 for spares.
+uint32_t preset_erases[PRESET_SECTORS]; // Erase count of each sector.
+uint16_t preset_active; // Sector records are appended to.
+uint32_t preset_head; // Offset in the active sector where the next record goes.
+uint32_t preset_version; // Version of the latest record.
+uint32_t preset_page[PRESET_PAGE_SIZE / 4]; // A page on its way to flash, IAP writes from word aligned RAM.
+uint16_t preset_fill; // Bytes in preset_page.
+uint16_t preset_crc; // CRC of the record being saved.
+
+void preset_init();
+uint16_t preset_save(uint8_t slot, uint16_t *filters_buf, uint16_t filters_count, uint32_t frequency);
+uint8_t preset_equal(uint8_t slot, uint16_t *filters_buf, uint16_t filters_count, uint32_t frequency);
+uint16_t preset_count(uint8_t slot);
+uint32_t preset_frequency(uint8_t slot);
+void preset_load(uint8_t slot, uint16_t *filters_buf);
+struct plan *preset_plan(uint8_t slot);
+uint16_t preset_build(uint8_t slot);
+
+#endif
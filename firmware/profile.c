@@ -0,0 +1,54 @@
+// Per-filter and per-interrupt cycle counting using the Cortex-M3 DWT cycle
+// counter. Everything here compiles out when PROFILE is not 1; when it is, the
+// cost is a single CYCCNT read and a handful of register operations per filter.
+
+#ifndef _HAPR_PROFILE
+#define _HAPR_PROFILE
+
+#include "LPC17xx.h"
+#include "lpc_types.h"
+
+#include "profile.h"
+
+// A blank profile struct used to reset statistics.
+static const struct profile EMPTY_PROFILE;
+
+// Enable the DWT cycle counter. It is free running and wraps every ~43s at
+// 100MHz, so deltas computed with unsigned subtraction are always correct.
+void profile_init()
+{
+	#if PROFILE==1
+	CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+	DWT->CYCCNT = 0;
+	DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+	#endif
+}
+
+// Clear statistics, used whenever a new filter graph is built.
+void profile_reset(struct profile *p)
+{
+	*p = EMPTY_PROFILE;
+}
+
+// Record one run taking the given number of cycles.
+// marked as inline to allow compiler optimizations
+inline void profile_record(struct profile *p, uint32_t cycles)
+{
+	p->last = cycles;
+	if (cycles > p->max)
+		p->max = cycles;
+	// Seed the mean with the first run so it doesn't have to climb up from zero.
+	if (p->mean == 0)
+		p->mean = cycles << PROFILE_MEAN_SHIFT;
+	else
+		p->mean += cycles - (p->mean >> PROFILE_MEAN_SHIFT);
+}
+
+// Running mean in cycles.
+// marked as inline to allow compiler optimizations
+inline uint32_t profile_mean(struct profile *p)
+{
+	return p->mean >> PROFILE_MEAN_SHIFT;
+}
+
+#endif
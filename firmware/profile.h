@@ -0,0 +1,24 @@
+#ifndef _HAPR_PROFILE_H
+#define _HAPR_PROFILE_H
+
+// Shift used for the running mean, which is an exponential moving average over
+// roughly 1 << PROFILE_MEAN_SHIFT samples.
+#define PROFILE_MEAN_SHIFT 8
+
+// Cycle count statistics for a filter or for the whole timer interrupt.
+struct profile
+{
+	uint32_t last; // Cycles taken by the most recent run.
+	uint32_t max; // Most cycles taken by any run since the graph was built.
+	uint32_t mean; // Running mean, scaled up by 1 << PROFILE_MEAN_SHIFT.
+};
+
+struct profile isr_profile;
+uint32_t boot_cycles; // Cycles from the start of main() to the first sample out of the chain.
+
+void profile_init();
+void profile_reset(struct profile *p);
+inline void profile_record(struct profile *p, uint32_t cycles);
+inline uint32_t profile_mean(struct profile *p);
+
+#endif
@@ -6,6 +6,8 @@
 struct queue *new_queue()
 { 
 	struct queue *queue = alloc_queue();
+	if (queue == NULL)
+		return NULL;
 	queue->head = NULL;
 	queue->tail = NULL;	
 	queue->current = NULL;
@@ -23,16 +25,20 @@ struct filter *dequeue(struct queue *q)
 			q->current = q->current->next;
 		}
 
-		filter = q->head->value;
-		free_queue_element(q->head);
-		q->head = q->head->next;
+		struct queue_element *head = q->head;
+		filter = head->value;
+		q->head = head->next;
+		free_queue_element(head);
 		return filter;
 	}
 }
 
-void enqueue(struct queue* q, struct filter *filter)
+// Returns 1 if the queue element pool is exhausted, leaving the queue as it was.
+uint16_t enqueue(struct queue* q, struct filter *filter)
 {
 	struct queue_element *qe = alloc_queue_element();
+	if (qe == NULL)
+		return 1;
 	qe->value = filter;
 	qe->next = NULL;
 
@@ -41,11 +47,11 @@ void enqueue(struct queue* q, struct filter *filter)
 		q->head = qe;
 		q->tail = qe;
 		q->current = qe;
-		return;
+		return 0;
 	} else {
 		q->tail->next = qe;
 		q->tail = qe;
-	 	return;
+	 	return 0;
 	}
 }
 
@@ -18,7 +18,7 @@ struct queue *new_queue();
 
 struct filter *dequeue(struct queue *q);
 
-void enqueue(struct queue* q, struct filter *filter);
+uint16_t enqueue(struct queue* q, struct filter *filter);
 
 inline void move_to_next(struct queue* q);
 void move_to_start(struct queue* q);
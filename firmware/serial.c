@@ -8,14 +8,140 @@
 
 #include "serial.h"
 
+// The UART is driven by its interrupt, at a lower priority than the audio timer.
+// Received bytes are queued in serial_rx until the main loop reads them, and
+// bytes written are queued in serial_tx until the transmit FIFO has room.
+volatile uint8_t serial_rx[SERIAL_RX_LENGTH];
+volatile uint16_t serial_rx_head = 0; // Next byte the interrupt will write.
+volatile uint16_t serial_rx_tail = 0; // Next byte the main loop will read.
+volatile uint8_t serial_tx[SERIAL_TX_LENGTH];
+volatile uint16_t serial_tx_head = 0; // Next byte the main loop will write.
+volatile uint16_t serial_tx_tail = 0; // Next byte the interrupt will send.
+volatile uint32_t serial_rx_dropped = 0; // Bytes lost because serial_rx was full.
+volatile uint32_t serial_ticks = 0; // Milliseconds since serial_init(), for timeouts.
+
+// Plain protocol command being assembled by command_poll().
+uint8_t command_buf[16];
+uint8_t command_length = 0;
+uint32_t command_tick; // serial_ticks when the last byte of it arrived.
+
+// Binary protocol (see serial.h). Negotiated with the version command, until then
+// and after it is left again commands are plain 16-byte frames.
+uint8_t serial_binary = 0; // Protocol version in use, 0 for the plain one.
+uint8_t frame_command; // Command of the last frame read.
+uint8_t frame_seq; // Sequence number of the last frame read, echoed in its replies.
+uint8_t frame_payload[FRAME_MAX_PAYLOAD]; // Payload of the last frame read.
+uint16_t frame_crc; // CRC of the frame being written.
+
+// Frame being assembled by frame_poll().
+uint8_t frame_state = FRAME_STATE_SYNC;
+uint8_t frame_header[5]; // Command, sequence number, status and length.
+uint8_t frame_crc_bytes[2];
+uint16_t frame_index; // Bytes of the current part of the frame read so far.
+uint16_t frame_length; // Payload length of the frame.
+uint32_t frame_tick; // serial_ticks when the last byte of it arrived.
+
+void SysTick_Handler()
+{
+	serial_ticks++;
+}
+
+// Move queued bytes into the transmit FIFO, if it is empty. Called from the
+// interrupt, or with it disabled.
+void serial_tx_fill()
+{
+	uint8_t n;
+	if (!(LPC_UART0->LSR & UART_LSR_THRE)) {
+		return;
+	}
+	for (n = 0; n < UART_TX_FIFO_SIZE && serial_tx_tail != serial_tx_head; n++) {
+		LPC_UART0->THR = serial_tx[serial_tx_tail];
+		serial_tx_tail = (serial_tx_tail + 1) & (SERIAL_TX_LENGTH - 1);
+	}
+}
+
+void UART0_IRQHandler()
+{
+	// reading the interrupt identification clears a transmit FIFO empty interrupt
+	(void)LPC_UART0->IIR;
+
+	while (LPC_UART0->LSR & UART_LSR_RDR) {
+		uint8_t byte = LPC_UART0->RBR;
+		uint16_t next = (serial_rx_head + 1) & (SERIAL_RX_LENGTH - 1);
+		if (next == serial_rx_tail) {
+			serial_rx_dropped++;
+		} else {
+			serial_rx[serial_rx_head] = byte;
+			serial_rx_head = next;
+		}
+	}
+
+	serial_tx_fill();
+}
+
+// Take a received byte, if there is one. Never waits.
+uint8_t serial_read(uint8_t *byte)
+{
+	if (serial_rx_tail == serial_rx_head) {
+		return 0;
+	}
+	*byte = serial_rx[serial_rx_tail];
+	serial_rx_tail = (serial_rx_tail + 1) & (SERIAL_RX_LENGTH - 1);
+	return 1;
+}
+
 int tty_read_blocking(char *buf,int length)
 {
-	return(UART_Receive((LPC_UART_TypeDef *)LPC_UART0, (uint8_t *)buf, length, BLOCKING));
+	int i;
+	for (i = 0; i < length; i++) {
+		while (!serial_read((uint8_t *)&buf[i])) {
+			__WFI();
+		}
+	}
+	return length;
 }
 
+// Queue bytes to be sent, only waiting while serial_tx is full.
 int tty_write_blocking(char *buf,int length)
 {
-	return(UART_Send((LPC_UART_TypeDef *)LPC_UART0,(uint8_t *)buf,length, BLOCKING));
+	int i;
+	for (i = 0; i < length; i++) {
+		uint16_t next = (serial_tx_head + 1) & (SERIAL_TX_LENGTH - 1);
+		while (next == serial_tx_tail) {
+			__WFI();
+		}
+		serial_tx[serial_tx_head] = buf[i];
+		serial_tx_head = next;
+	}
+
+	// start sending if the transmitter is idle, otherwise the interrupt carries on
+	NVIC_DisableIRQ(UART0_IRQn);
+	serial_tx_fill();
+	NVIC_EnableIRQ(UART0_IRQn);
+
+	return length;
+}
+
+// Assemble a plain 16-byte command from the bytes received so far. Returns 1 once a
+// whole one has been copied to command. A partial command followed by silence for
+// COMMAND_TIMEOUT is dropped, so a lost byte only loses that command rather than
+// shifting every command after it.
+uint8_t command_poll(char *command)
+{
+	uint8_t byte;
+	if (command_length > 0 && serial_ticks - command_tick > COMMAND_TIMEOUT) {
+		command_length = 0;
+	}
+	while (serial_read(&byte)) {
+		command_buf[command_length++] = byte;
+		command_tick = serial_ticks;
+		if (command_length == 16) {
+			command_length = 0;
+			memcpy(command, command_buf, 16);
+			return 1;
+		}
+	}
+	return 0;
 }
 
 void tty_write(char *buf){
@@ -29,6 +155,12 @@ void tty_write(char *buf){
 }
 
 void tty_writeln(char *buf){
+	// in the binary protocol every line is a reply frame of its own
+	if (serial_binary) {
+		frame_reply(FRAME_STATUS_MORE, (uint8_t *)buf, strlen(buf));
+		return;
+	}
+
 	tty_write(buf);
 
 	// for some reason, there is a bug in the pySerial library...
@@ -95,28 +227,123 @@ void tty_writeln_int(int n) {
   tty_writeln("");
 }
 
-void serial_init()
+// CRC-16/CCITT (polynomial 0x1021, no reflection) of a run of bytes, continuing
+// from crc. Start with 0xFFFF.
+uint16_t crc16(uint16_t crc, uint8_t *data, uint32_t length)
 {
-	UART_CFG_Type UARTConfigStruct; // UART Configuration structure variable
-	UART_FIFO_CFG_Type UARTFIFOConfigStruct; // UART FIFO configuration Struct variable
-	PINSEL_CFG_Type PinCfg; // Pin configuration for UART
+	uint32_t i;
+	uint8_t bit;
+	for (i = 0; i < length; i++) {
+		crc ^= data[i] << 8;
+		for (bit = 0; bit < 8; bit++) {
+			crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : (crc << 1);
+		}
+	}
+	return crc;
+}
 
-	PinCfg.Funcnum = 1;
-	PinCfg.OpenDrain = 0;
-	PinCfg.Pinmode = 0;
+// Assemble a frame from the bytes received so far, into frame_command, frame_seq and
+// frame_payload. Returns 1 once a whole one has arrived, setting its payload length
+// and FRAME_STATUS_OK or why it was rejected. Bytes before FRAME_SYNC are skipped, and
+// a partial frame followed by silence for COMMAND_TIMEOUT is dropped.
+uint8_t frame_poll(uint16_t *length, uint8_t *status)
+{
+	uint8_t byte;
+	if (frame_state != FRAME_STATE_SYNC && serial_ticks - frame_tick > COMMAND_TIMEOUT) {
+		frame_state = FRAME_STATE_SYNC;
+	}
+	while (serial_read(&byte)) {
+		frame_tick = serial_ticks;
+		switch (frame_state) {
+		case FRAME_STATE_SYNC:
+			if (byte == FRAME_SYNC) {
+				frame_index = 0;
+				frame_state = FRAME_STATE_HEADER;
+			}
+			break;
+		case FRAME_STATE_HEADER:
+			frame_header[frame_index++] = byte;
+			if (frame_index == 5) {
+				frame_command = frame_header[0];
+				frame_seq = frame_header[1];
+				frame_length = frame_header[3] | (frame_header[4] << 8);
+				frame_index = 0;
+				if (frame_length > FRAME_MAX_PAYLOAD) {
+					frame_state = FRAME_STATE_SYNC;
+					*length = 0;
+					*status = FRAME_STATUS_LENGTH;
+					return 1;
+				}
+				frame_state = frame_length ? FRAME_STATE_PAYLOAD : FRAME_STATE_CRC;
+			}
+			break;
+		case FRAME_STATE_PAYLOAD:
+			frame_payload[frame_index++] = byte;
+			if (frame_index == frame_length) {
+				frame_index = 0;
+				frame_state = FRAME_STATE_CRC;
+			}
+			break;
+		case FRAME_STATE_CRC:
+			frame_crc_bytes[frame_index++] = byte;
+			if (frame_index == 2) {
+				frame_state = FRAME_STATE_SYNC;
+				*length = frame_length;
+				*status = crc16(crc16(0xFFFF, frame_header, 5), frame_payload, frame_length)
+					== (frame_crc_bytes[0] | (frame_crc_bytes[1] << 8)) ? FRAME_STATUS_OK : FRAME_STATUS_CRC;
+				return 1;
+			}
+			break;
+		}
+	}
+	return 0;
+}
 
-	PinCfg.Portnum = 0;
-	PinCfg.Pinnum = 2;
-	PINSEL_ConfigPin(&PinCfg);
-	PinCfg.Pinnum = 3;
-	PINSEL_ConfigPin(&PinCfg);
+// Start a reply frame to the last frame read, with a payload of length bytes which
+// must then be written with frame_put() before frame_end().
+void frame_begin(uint8_t status, uint16_t length)
+{
+	uint8_t header[6] = { FRAME_SYNC, frame_command, frame_seq, status, length, length >> 8 };
+	tty_write_blocking((char *)header, 6);
+	frame_crc = crc16(0xFFFF, &header[1], 5);
+}
+
+// Write part of the payload of a reply frame.
+void frame_put(uint8_t *data, uint16_t length)
+{
+	tty_write_blocking((char *)data, length);
+	frame_crc = crc16(frame_crc, data, length);
+}
+
+// Finish a reply frame.
+void frame_end()
+{
+	uint8_t crc[2] = { frame_crc, frame_crc >> 8 };
+	tty_write_blocking((char *)crc, 2);
+}
+
+// Write a whole reply frame to the last frame read.
+void frame_reply(uint8_t status, uint8_t *data, uint16_t length)
+{
+	frame_begin(status, length);
+	frame_put(data, length);
+	frame_end();
+}
+
+// Change the baud rate, once everything already written has been sent.
+void serial_set_baud(uint32_t baud)
+{
+	UART_CFG_Type UARTConfigStruct; // UART Configuration structure variable
+	UART_FIFO_CFG_Type UARTFIFOConfigStruct; // UART FIFO configuration Struct variable
 
-	UARTConfigStruct.Baud_rate = 9600;
-	UARTConfigStruct.Databits = 8;
-	UARTConfigStruct.Stopbits = 1;
-	UARTConfigStruct.Parity = UART_PARITY_NONE;
+	while (serial_tx_tail != serial_tx_head) {
+		__WFI();
+	}
+	while (!(UART_GetLineStatus((LPC_UART_TypeDef *)LPC_UART0) & UART_LINESTAT_TEMT));
 
+	// defaults are 8 data bits, 1 stop bit and no parity
 	UART_ConfigStructInit(&UARTConfigStruct);
+	UARTConfigStruct.Baud_rate = baud;
 
 	UARTFIFOConfigStruct.FIFO_DMAMode = DISABLE;
 	UARTFIFOConfigStruct.FIFO_Level = UART_FIFO_TRGLEV0;
@@ -130,6 +357,33 @@ void serial_init()
 	UART_FIFOConfig((LPC_UART_TypeDef *)LPC_UART0, &UARTFIFOConfigStruct);
 
 	UART_TxCmd((LPC_UART_TypeDef *)LPC_UART0, ENABLE);
+
+	// UART_Init() disables the interrupts
+	UART_IntConfig((LPC_UART_TypeDef *)LPC_UART0, UART_INTCFG_RBE, ENABLE);
+	UART_IntConfig((LPC_UART_TypeDef *)LPC_UART0, UART_INTCFG_THRE, ENABLE);
+}
+
+void serial_init()
+{
+	PINSEL_CFG_Type PinCfg; // Pin configuration for UART
+
+	PinCfg.Funcnum = 1;
+	PinCfg.OpenDrain = 0;
+	PinCfg.Pinmode = 0;
+
+	PinCfg.Portnum = 0;
+	PinCfg.Pinnum = 2;
+	PINSEL_ConfigPin(&PinCfg);
+	PinCfg.Pinnum = 3;
+	PINSEL_ConfigPin(&PinCfg);
+
+	serial_set_baud(SERIAL_BAUDRATE);
+
+	// millisecond ticks for the command timeouts, SysTick gets the lowest priority
+	SysTick_Config(SystemCoreClock / 1000);
+
+	NVIC_SetPriority(UART0_IRQn, SERIAL_PRIORITY);
+	NVIC_EnableIRQ(UART0_IRQn);
 }
 
 #endif
@@ -1,6 +1,35 @@
 #ifndef _HAPR_SERIAL_H
 #define _HAPR_SERIAL_H
 
+#define SERIAL_BAUDRATE 9600 // Baud rate at reset, and of the plain protocol.
+#define SERIAL_RX_LENGTH 256 // Bytes buffered on receive, power of two.
+#define SERIAL_TX_LENGTH 256 // Bytes buffered on transmit, power of two.
+#define SERIAL_PRIORITY ((0x02<<3)|0x01) // UART interrupt priority, below the audio timer (see timer.c).
+#define COMMAND_TIMEOUT 50 // Milliseconds of silence after which a partial command or frame is dropped.
+
+// Binary protocol, negotiated with the version command. Requests and replies are
+// frames of: FRAME_SYNC, command, sequence number, status, payload length (2 bytes,
+// little endian), payload, CRC-16/CCITT of everything after FRAME_SYNC (2 bytes,
+// little endian). Each request gets replies in order with its command and sequence
+// number: any number with FRAME_STATUS_MORE, then exactly one final reply.
+#define PROTOCOL_VERSION 1 // Highest protocol version supported.
+#define FRAME_SYNC 0xA5 // First byte of every frame.
+#define FRAME_MAX_PAYLOAD (8 * FILTER_ALLOC_SIZE) // Largest request, a whole filter chain.
+#define FRAME_STATUS_OK 0 // Command done, final reply.
+#define FRAME_STATUS_CRC 1 // Request was corrupted and ignored.
+#define FRAME_STATUS_LENGTH 2 // Request was longer than FRAME_MAX_PAYLOAD and ignored.
+#define FRAME_STATUS_COMMAND 3 // Unknown command.
+#define FRAME_STATUS_INIT 4 // Filter chain refused, payload: filter_init() error, max frequency (4 bytes).
+#define FRAME_STATUS_ERROR 5 // Command failed, the lines of text before say why.
+#define FRAME_STATUS_MORE 0x80 // Not the final reply, payload is a line of text.
+
+// States of frame_poll().
+#define FRAME_STATE_SYNC 0 // Waiting for FRAME_SYNC.
+#define FRAME_STATE_HEADER 1
+#define FRAME_STATE_PAYLOAD 2
+#define FRAME_STATE_CRC 3
+
+uint8_t serial_read(uint8_t *byte);
 int tty_read_blocking(char *buf,int length);
 int tty_write_blocking(char *buf,int length);
 void tty_write(char *buf);
@@ -9,6 +38,14 @@ void tty_write_binaryten(uint32_t n);
 void tty_write_binary(int n);
 void tty_write_int(int n);
 void tty_writeln_int(int n);
+uint16_t crc16(uint16_t crc, uint8_t *data, uint32_t length);
+uint8_t command_poll(char *command);
+uint8_t frame_poll(uint16_t *length, uint8_t *status);
+void frame_begin(uint8_t status, uint16_t length);
+void frame_put(uint8_t *data, uint16_t length);
+void frame_end();
+void frame_reply(uint8_t status, uint8_t *data, uint16_t length);
+void serial_set_baud(uint32_t baud);
 void serial_init();
 
 
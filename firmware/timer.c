@@ -5,82 +5,187 @@
 #include "lpc_types.h"
 #include "lpc17xx_pinsel.h"
 #include "lpc17xx_dac.h"
+#include "lpc17xx_gpdma.h"
 
 #include "adc.h"
+#include "dac.h"
 #include "scramble.h"
 #include "filter_chain.h"
+#include "profile.h"
 #include "timer.h"
 
+// Audio is processed a block at a time. The DAC's own counter, set to the sample
+// period, asks the GPDMA for every sample, which the DMA takes from one half of
+// dac_block while the interrupt at the end of the other half fills that with the
+// next AUDIO_BLOCK samples. The chain has a whole block period to run a block in,
+// and however its cost varies from sample to sample the DAC is updated on the tick.
+#define XRUN_BYPASS_LIMIT 0 // consecutive overruns before falling back to bypass, 0 disables
+
 uint16_t cycle = 0;
 uint16_t frequency = 20000;
 
+// Microseconds between samples.
+uint32_t timer_period;
+
+// The halves of dac_block, each linked to the other so the DMA plays them in turn.
+GPDMA_LLI_Type dac_lli[2];
+
+// Overrun statistics, cleared whenever the timer is started.
+uint32_t xrun_count = 0; // Blocks which weren't ready by the time the DMA needed them.
+uint32_t xrun_missed = 0; // Samples the DAC played from a block still being filled.
+uint32_t xrun_late_max = 0; // Worst lateness of interrupt entry in us.
+uint16_t xrun_consecutive = 0; // Overruns in a row, reset by a block finished in time.
+uint16_t xrun_bypass_limit = XRUN_BYPASS_LIMIT;
+uint8_t xrun_bypass = 0; // Set when the filter chain is being bypassed after too many overruns.
+
 void timer_init(int frequency)
 {
-	TIM_TIMERCFG_Type TIM_ConfigStruct;
-	TIM_MATCHCFG_Type TIM_MatchConfigStruct;
-
-	PINSEL_CFG_Type PinCfg;
-
-	PinCfg.Funcnum = 3;
-	PinCfg.OpenDrain = 0;
-	PinCfg.Pinmode = 0;
-	PinCfg.Portnum = 1;
-	PinCfg.Pinnum = 28;
-	PINSEL_ConfigPin(&PinCfg);
-
-	TIM_ConfigStruct.PrescaleOption = TIM_PRESCALE_USVAL;
-	TIM_ConfigStruct.PrescaleValue	= 10;
-	TIM_MatchConfigStruct.MatchChannel = 0;
-	// Enable interrupt when MR0 matches the value in TC register
-	TIM_MatchConfigStruct.IntOnMatch = TRUE;
-	// Enable reset on MR0: TIMER will reset if MR0 matches it
-	TIM_MatchConfigStruct.ResetOnMatch = TRUE;
-	// Stop on MR0 if MR0 matches it
-	TIM_MatchConfigStruct.StopOnMatch = FALSE;
-	// Toggle MR0.0 pin if MR0 matches it
-	TIM_MatchConfigStruct.ExtMatchOutputType = TIM_EXTMATCH_NOTHING;
-	// Set Match value, count value of 100000 (100000 * 10uS = 1000000us = 1s --> 1 Hz)
-	TIM_MatchConfigStruct.MatchValue = (int) 100000.0 / frequency;
-
-	TIM_Init(LPC_TIM0, TIM_TIMER_MODE, &TIM_ConfigStruct);
-	TIM_ConfigMatch(LPC_TIM0, &TIM_MatchConfigStruct);
+	DAC_CONVERTER_CFG_Type DAC_ConverterConfigStruct;
+	uint16_t i;
+
+	timer_period = 1000000 / frequency;
+
+	// The DAC counter runs at CCLK/4 like timer 1, which paces the ADC (see adc.c),
+	// so input and output keep step. Double buffering updates the output on the
+	// tick rather than whenever the DMA gets round to writing it.
+	DAC_ConverterConfigStruct.DBLBUF_ENA = 1;
+	DAC_ConverterConfigStruct.CNT_ENA = 1;
+	DAC_ConverterConfigStruct.DMA_ENA = 1;
+	DAC_SetDMATimeOut(LPC_DAC, TIMER_TICKS_PER_US * timer_period);
+	DAC_ConfigDAConverterControl(LPC_DAC, &DAC_ConverterConfigStruct);
+
+	dac_block = (uint32_t *)AUDIO_DMA_BASE + ADC_RING_LENGTH;
+	for (i = 0; i < 2; i++) {
+		dac_lli[i].SrcAddr = (uint32_t)&dac_block[i * AUDIO_BLOCK];
+		dac_lli[i].DstAddr = (uint32_t)&LPC_DAC->DACR;
+		dac_lli[i].NextLLI = (uint32_t)&dac_lli[1 - i];
+		dac_lli[i].Control = GPDMA_DMACCxControl_TransferSize(AUDIO_BLOCK) |
+			GPDMA_DMACCxControl_SBSize(GPDMA_BSIZE_1) | GPDMA_DMACCxControl_DBSize(GPDMA_BSIZE_1) |
+			GPDMA_DMACCxControl_SWidth(GPDMA_WIDTH_WORD) | GPDMA_DMACCxControl_DWidth(GPDMA_WIDTH_WORD) |
+			GPDMA_DMACCxControl_SI | GPDMA_DMACCxControl_I;
+	}
+
+	// conversions for adc_get_data() are taken at a multiple of the same rate
+	adc_rate(timer_period);
+
 	// preemption = 1, sub-priority = 1
-	NVIC_SetPriority(TIMER0_IRQn, ((0x01<<3)|0x01));
+	NVIC_SetPriority(DMA_IRQn, ((0x01<<3)|0x01));
+}
+
+// Clear overrun statistics and leave bypass, a new chain or frequency gets a fresh start.
+void xrun_reset() {
+	xrun_count = 0;
+	xrun_missed = 0;
+	xrun_late_max = 0;
+	xrun_consecutive = 0;
+	xrun_bypass = 0;
 }
 
+// Does nothing while no chain is built, after an apply or load which failed.
 void timer_start() {
-	TIM_Cmd(LPC_TIM0,ENABLE);
-	NVIC_EnableIRQ(TIMER0_IRQn);
+	uint16_t i;
+
+	if (q == NULL) {
+		return;
+	}
+
+	xrun_reset();
+
+	// Both halves start out silent, the first is filled once the DMA has played it.
+	for (i = 0; i < 2 * AUDIO_BLOCK; i++) {
+		dac_block[i] = DAC_WORD(VALUE_ZERO);
+	}
+	AUDIO_DMA_CHANNEL->DMACCSrcAddr = dac_lli[0].SrcAddr;
+	AUDIO_DMA_CHANNEL->DMACCDestAddr = dac_lli[0].DstAddr;
+	AUDIO_DMA_CHANNEL->DMACCLLI = dac_lli[0].NextLLI;
+	AUDIO_DMA_CHANNEL->DMACCControl = dac_lli[0].Control;
+	LPC_GPDMA->DMACIntTCClear = AUDIO_DMA_MASK;
+	LPC_GPDMA->DMACIntErrClr = AUDIO_DMA_MASK;
+	AUDIO_DMA_CHANNEL->DMACCConfig = GPDMA_DMACCxConfig_E |
+		GPDMA_DMACCxConfig_DestPeripheral(AUDIO_DMA_REQUEST) |
+		GPDMA_DMACCxConfig_TransferType(GPDMA_TRANSFERTYPE_M2P) |
+		GPDMA_DMACCxConfig_IE | GPDMA_DMACCxConfig_ITC;
+	NVIC_EnableIRQ(DMA_IRQn);
 }
 
+// The DAC keeps the last sample it was given.
 void timer_stop() {
-	NVIC_DisableIRQ(TIMER0_IRQn);
-	TIM_Cmd(LPC_TIM0,DISABLE);
+	NVIC_DisableIRQ(DMA_IRQn);
+	AUDIO_DMA_CHANNEL->DMACCConfig = 0;
+	dac_sample = &dac_spare;
 }
 
-void TIMER0_IRQHandler ()
+// Run a block of samples, from the input to dac_block.
+void DMA_IRQHandler ()
 {
-	if (TIM_GetIntStatus(LPC_TIM0, TIM_MR0_INT) == SET) {
-		NVIC_DisableIRQ(TIMER0_IRQn); //disable interrupt, to prevent it from overlapping if it takes too long to process
-    	TIM_ClearIntPending(LPC_TIM0,TIM_MR0_INT);
-        TIM_ResetCounter(LPC_TIM0);
+	#if PROFILE==1
+	uint32_t isr_start = DWT->CYCCNT;
+	#endif
+	uint16_t i;
+
+	// only audio output interrupts, the ADC's channel runs on its own
+	if ((LPC_GPDMA->DMACIntTCStat & AUDIO_DMA_MASK) == 0) {
+		LPC_GPDMA->DMACIntErrClr = LPC_GPDMA->DMACIntErrStat;
+		return;
+	}
+	LPC_GPDMA->DMACIntTCClear = AUDIO_DMA_MASK;
 
-        #if DEBUG==1 && TRACE==1
-		tty_writeln("Timer trigger");
-		#endif
+	// The half the DMA has just finished is the one it will move on to next, and
+	// what it has played of the other since is how late this interrupt was entered.
+	GPDMA_LLI_Type *free = (GPDMA_LLI_Type *)AUDIO_DMA_CHANNEL->DMACCLLI;
+	uint32_t *block = (uint32_t *)free->SrcAddr;
+	uint32_t late = (AUDIO_BLOCK - (AUDIO_DMA_CHANNEL->DMACCControl & 0xFFF)) * timer_period;
+	if (late > xrun_late_max)
+		xrun_late_max = late;
+
+	#if DEBUG==1 && TRACE==1
+	tty_writeln("Block trigger");
+	#endif
+
+	for (i = 0; i < AUDIO_BLOCK; i++) {
+		dac_sample = &block[i];
+		adc_sample();
 
 		if (scramble_mode) {
 			scramble_timer_handler();
+		} else if (xrun_bypass) {
+			dac_set_value(adc_get_data());
+		#ifdef COMPILED_CHAIN
+		} else if (compiled_chain_active) {
+			compiled_chain();
+		#endif
 		} else {
-	        filter_loop();
-	    }
+			filter_loop();
+		}
 
-        cycle++; //used for sine wave generation
+		cycle++; //used for sine wave generation
 		if(cycle > frequency)
 			cycle = 0;
-
-        NVIC_EnableIRQ(TIMER0_IRQn);
 	}
+	dac_sample = &dac_spare;
+
+	// If the DMA has moved on to the half being filled, the block came too late.
+	if (AUDIO_DMA_CHANNEL->DMACCLLI == (uint32_t)free) {
+		xrun_consecutive = 0;
+	} else {
+		xrun_count++;
+		xrun_missed += AUDIO_BLOCK;
+		xrun_consecutive++;
+
+		// Too many in a row means the chain can't keep up: rather than turning into
+		// noise, pass the input straight through until a new chain is applied.
+		if (xrun_bypass_limit != 0 && xrun_consecutive >= xrun_bypass_limit) {
+			xrun_bypass = 1;
+		}
+	}
+
+	#if PROFILE==1
+	// the cycle counter is started first thing in main()
+	if (boot_cycles == 0)
+		boot_cycles = DWT->CYCCNT;
+	// per sample, as the costs of the filters are
+	profile_record(&isr_profile, (DWT->CYCCNT - isr_start) / AUDIO_BLOCK);
+	#endif
 }
 
 #endif
@@ -1,11 +1,31 @@
 #ifndef _HAPR_TIMER_H
 #define _HAPR_TIMER_H
 
+#ifndef AUDIO_BLOCK
+#define AUDIO_BLOCK 16 // Samples processed at a time. Larger blocks leave more headroom for chains of uneven cost, at AUDIO_BLOCK samples more latency in each direction.
+#endif
+#define AUDIO_DMA_CHANNEL LPC_GPDMACH0 // Highest priority, output must never wait.
+#define AUDIO_DMA_MASK (1<<0) // Bit of AUDIO_DMA_CHANNEL in the GPDMA interrupt registers.
+#define AUDIO_DMA_REQUEST 7 // GPDMA request line of the DAC.
+#define TIMER_TICKS_PER_US (SystemCoreClock / 4 / 1000000) // Timer 1 and the DAC counter run at CCLK/4.
+// The buffers the DMA reads and writes are kept at the end of the AHB SRAM, after
+// the second sample pool (see alloc.c): the ADC ring, then dac_block.
+#define AUDIO_DMA_BYTES (((ADC_RING_LENGTH + 2 * AUDIO_BLOCK) * 4 + 31) & ~31)
+#define AUDIO_DMA_BASE (0x20084000 - AUDIO_DMA_BYTES)
+
 uint16_t cycle;
 uint16_t frequency;
 
+uint32_t xrun_count;
+uint32_t xrun_missed;
+uint32_t xrun_late_max;
+uint16_t xrun_consecutive;
+uint16_t xrun_bypass_limit;
+uint8_t xrun_bypass;
+
 void timer_init(int frequency);
+void xrun_reset();
 void timer_start();
 void timer_stop();
 
-#endif
\ No newline at end of file
+#endif
@@ -0,0 +1,627 @@
+#!/usr/bin/env python
+
+# Compiles a filter chain to straight-line C: one function which runs every filter
+# of the chain in the order filter_loop() would, each kernel of
+# firmware/filter_chain.c written out in place with its parameters folded into
+# constants and its buffers placed statically, sized to what is read of them.
+# Built into the firmware with COMPILED_CHAIN (see firmware/main.c) it runs in place
+# of the filter queue while the chain applied is the one it was compiled from, or
+# it can be built into a host renderer which provides the few firmware globals it
+# uses (see HOST_PRELUDE).
+#
+# Usage:
+#   python chain2c.py chain.txt > chain.c
+#   python chain2c.py --flash dump.bin --slot 3 > chain.c
+# A chain file has one filter per line, the 8 numbers of filters_buf separated by
+# commas or spaces, # starts a comment. A flash dump is of the whole flash or of
+# the preset log on from sector 22 (0x40000); the latest preset of the slot is used.
+
+from __future__ import print_function
+
+import math
+import re
+import struct
+import sys
+
+# See firmware/filter_chain.h and filter_chain.c
+VALUE_RANGE = 3300
+VALUE_ZERO = 2000
+NUMBER_OF_STEPS = 100
+ADC_STEP_NUMERATOR = VALUE_RANGE # ADC_STEP is expanded unparenthesised, param*3300/100
+PI = 3.14159265359
+TWO_PI = 6.28318530718
+ADC_CHANNELS = 3
+CONTROL_RATE = 32
+
+REGULAR_BUFFER_SIZE = 16
+DELAY_BUFFER_SIZE = 4096
+FLANGE_BUFFER_SIZE = 256
+PASS_BUFFER_SIZE = 32
+NOISE_BUFFER_SIZE = 2048
+
+INPUT, OUTPUT, PASSTHROUGH, ZERO, MAX, MIN, SINE, REVERB, DELAY, MIX, TREMOLO, FLANGE, \
+	UPWARD_COMPRESSOR, DOWNWARD_COMPRESSOR, N_BITS, DISTORTION, TRIANGLE, NOISE_CANCELLATION, \
+	AEC_LOWPASS, AEC_HIGHPASS, AEC_ALLPASS, CHANNEL = range(22)
+
+FILTER_NAMES = ["input", "output", "passthrough", "zero", "max", "min", "sine", "reverb",
+	"delay", "mix", "tremolo", "flange", "upward compressor", "downward compressor",
+	"n bits", "distortion", "triangle", "noise cancellation", "lowpass", "highpass",
+	"allpass", "channel input"]
+
+FILTER_FUNCTION_SIZES = [REGULAR_BUFFER_SIZE] * 22
+FILTER_FUNCTION_SIZES[REVERB] = DELAY_BUFFER_SIZE
+FILTER_FUNCTION_SIZES[DELAY] = DELAY_BUFFER_SIZE
+FILTER_FUNCTION_SIZES[FLANGE] = FLANGE_BUFFER_SIZE
+FILTER_FUNCTION_SIZES[NOISE_CANCELLATION] = NOISE_BUFFER_SIZE
+FILTER_FUNCTION_SIZES[AEC_LOWPASS] = PASS_BUFFER_SIZE
+FILTER_FUNCTION_SIZES[AEC_HIGHPASS] = PASS_BUFFER_SIZE
+FILTER_FUNCTION_SIZES[AEC_ALLPASS] = PASS_BUFFER_SIZE
+
+# See firmware/alloc.c
+BUF_STORAGE_PACKED = 1
+BUF_STORAGE_ULAW = 2
+
+# Preset log, see firmware/preset.h
+PRESET_LOG_ADDRESS = 0x40000 # sector 22
+PRESET_SECTORS = 4
+PRESET_SECTOR_SIZE = 32768
+PRESET_PAGE_SIZE = 256
+PRESET_SLOTS = 11
+PRESET_SECTOR_MAGIC = 0x4C504148
+PRESET_RECORD_MAGIC = 0x5052
+PRESET_NO_PLAN = 0xFF
+PRESET_FIRST_RECORD = 2 * PRESET_PAGE_SIZE
+PRESET_RECORD_HEADER = struct.Struct("<HHBBHII")
+PLAN_LENGTH = 4 # struct plan
+PLAN_FILTER_LENGTH = 12 # struct plan_filter
+
+# What a build of the firmware defines and the generated code uses, declared for
+# anything else it is built into.
+HOST_PRELUDE = """#include <math.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifndef _HAPR_ADC_H
+// Built outside the firmware, e.g. into a host renderer, which provides these.
+extern uint16_t cycle; // Sample in the current second, wraps at frequency.
+extern uint16_t frequency;
+extern uint16_t adc_frame[3]; // Current sample of each ADC channel.
+uint16_t adc_get_data(void); // Current sample of the guitar.
+void dac_set_value(uint16_t value);
+#endif
+"""
+
+class ChainError(Exception):
+	pass
+
+# Round to single precision, as the firmware's float arithmetic does.
+def f32(x):
+	return struct.unpack("<f", struct.pack("<f", x))[0]
+
+def u16(x):
+	return int(x) & 0xFFFF
+
+def float_literal(x):
+	s = "%.9g" % x
+	if "e" not in s and "." not in s and "inf" not in s and "nan" not in s:
+		s += ".0"
+	return s + "f"
+
+def double_literal(x):
+	s = repr(float(x))
+	if "e" not in s and "." not in s:
+		s += ".0"
+	return s
+
+# (param*(VALUE_RANGE-VALUE_ZERO))/NUMBER_OF_STEPS as the kernels work it out.
+def scaled_amplitude(param):
+	return u16(f32(f32(float(param)) * (VALUE_RANGE - VALUE_ZERO)) / NUMBER_OF_STEPS)
+
+# (param*TWO_PI)/NUMBER_OF_STEPS, truncated to a uint16_t as the kernels do.
+def scaled_phase(param):
+	return u16(f32(f32(float(param)) * TWO_PI) / NUMBER_OF_STEPS)
+
+# Coefficients filter_init() gives the high, low and all-pass filters, for the
+# values each term is multiplied by, quirks included.
+def aec_coefficients(kind):
+	if kind == AEC_LOWPASS:
+		fs, f0, q = 2000, 1000, 1000
+	else:
+		fs, f0, q = 2000, 1, 10
+	w0 = f32(2 * PI * f0 / fs)
+	cw0 = f32(math.cos(w0))
+	sw0 = f32(math.sin(w0))
+	alpha = f32(sw0 / (2 * q))
+	if kind == AEC_LOWPASS:
+		omcw0 = f32(1 - cw0)
+		b = [f32(omcw0 / 2), omcw0, f32(omcw0 / 2)]
+	elif kind == AEC_HIGHPASS:
+		omcw0 = f32(1 + cw0)
+		b = [f32(omcw0 / 2), -omcw0, f32(omcw0 / 2)]
+	else:
+		b = [f32(1 - alpha), f32(-2 * cw0), f32(1 + alpha)]
+	a = [f32(1 + alpha), f32(-2 * cw0), f32(1 - alpha)]
+	# the allpass divides its first term by the lowpass a0, all of them subtract
+	# b2 rather than a2 for y2
+	a0 = aec_coefficients(AEC_LOWPASS)[0][0] if kind == AEC_ALLPASS else a[0]
+	return (a, [f32(b[0] / a0), f32(b[1] / a[0]), f32(b[2] / a[0]), f32(a[1] / a[0]), f32(b[2] / a[0])])
+
+def crc16(crc, data):
+	for byte in bytearray(data):
+		crc ^= byte << 8
+		for bit in range(8):
+			crc = ((crc << 1) ^ 0x1021) if crc & 0x8000 else (crc << 1)
+			crc &= 0xFFFF
+	return crc
+
+def read_chain_file(path):
+	rows = []
+	with open(path) as f:
+		for number, line in enumerate(f, 1):
+			line = line.split("#")[0].strip()
+			if not line:
+				continue
+			values = [int(v) for v in re.split(r"[,\s]+", line) if v]
+			if len(values) != 8:
+				raise ChainError("%s:%d: a filter has 8 values, not %d" % (path, number, len(values)))
+			rows.append(values)
+	return rows
+
+# Latest preset of a slot in a dump of the preset log, as preset_init() indexes it.
+def read_flash_preset(path, slot):
+	with open(path, "rb") as f:
+		data = f.read()
+	if len(data) >= PRESET_LOG_ADDRESS + PRESET_SECTORS * PRESET_SECTOR_SIZE:
+		data = data[PRESET_LOG_ADDRESS:]
+	latest = None
+	for n in range(PRESET_SECTORS):
+		base = n * PRESET_SECTOR_SIZE
+		sector = data[base:base + PRESET_SECTOR_SIZE]
+		if len(sector) < PRESET_SECTOR_SIZE or struct.unpack_from("<I", sector, 0)[0] != PRESET_SECTOR_MAGIC:
+			continue
+		offset = PRESET_FIRST_RECORD
+		while offset + PRESET_RECORD_HEADER.size <= PRESET_SECTOR_SIZE:
+			magic, crc, record_slot, plan, length, version, record_frequency = PRESET_RECORD_HEADER.unpack_from(sector, offset)
+			if magic != PRESET_RECORD_MAGIC or record_slot >= PRESET_SLOTS:
+				break
+			data_length = length + (0 if plan == PRESET_NO_PLAN else PLAN_LENGTH + plan * PLAN_FILTER_LENGTH)
+			size = (PRESET_RECORD_HEADER.size + data_length + PRESET_PAGE_SIZE - 1) & ~(PRESET_PAGE_SIZE - 1)
+			end = offset + PRESET_RECORD_HEADER.size + data_length
+			if offset + size > PRESET_SECTOR_SIZE or crc16(0xFFFF, sector[offset + 4:end]) != crc:
+				break
+			if record_slot == slot and (latest is None or version >= latest[0]):
+				chain = bytearray(sector[offset + PRESET_RECORD_HEADER.size:offset + PRESET_RECORD_HEADER.size + length])
+				latest = (version, [list(chain[i:i + 8]) for i in range(0, length - length % 8, 8)])
+			offset += size
+	if latest is None:
+		raise ChainError("%s: no preset in slot %d" % (path, slot))
+	return latest[1]
+
+class Filter:
+	def __init__(self, index, row):
+		self.index = index
+		self.type, self.id = row[0], row[1]
+		self.params = row[4:8]
+		self.multi_input = self.type in (MIX, FLANGE)
+		self.links = [] # (filter, buf_n) for next, then next2
+		self.next = None # filter->next, which the high, low and all-pass filters read
+		self.position = None # in the order the chain runs, None if it never does
+		self.control = None # control slot, for filters with an LFO
+
+	def name(self):
+		return "%s (id %d)" % (FILTER_NAMES[self.type], self.id)
+
+	# Samples in the first buffer as new_filter() sets it up, which delays scale by.
+	def buf0_size(self):
+		size = FILTER_FUNCTION_SIZES[self.type] << self.multi_input
+		if self.type in (DELAY, REVERB):
+			if self.params[3] == BUF_STORAGE_PACKED:
+				return (size * 4) // 3
+			if self.params[3] == BUF_STORAGE_ULAW:
+				return size * 2
+		return size
+
+	def delay(self):
+		return u16(f32(f32(float(self.params[0])) * (self.buf0_size() - 1)) / NUMBER_OF_STEPS)
+
+	def flange_delay(self):
+		return u16(f32(f32(float(self.params[2])) * FLANGE_BUFFER_SIZE) / NUMBER_OF_STEPS)
+
+	# Oldest sample read of each buffer: (filter, buf_n, position).
+	def reads(self):
+		if self.type in (INPUT, CHANNEL, ZERO, SINE, TRIANGLE):
+			return []
+		if self.type == MIX:
+			return [(self, 0, 0), (self, 1, 0)]
+		if self.type == REVERB:
+			return [(self, 0, max(1, self.delay()))]
+		if self.type == DELAY:
+			return [(self, 0, self.delay())]
+		if self.type == FLANGE:
+			return [(self, 0, self.flange_delay())]
+		if self.type == NOISE_CANCELLATION:
+			return [(self, 0, self.params[1])]
+		if self.type in (AEC_LOWPASS, AEC_HIGHPASS, AEC_ALLPASS):
+			return [(self, 0, 2)] + ([(self.next, 0, 2)] if self.next else [])
+		return [(self, 0, 0)]
+
+# Link and order the chain as filter_init() does, raising its errors.
+def build(rows):
+	if not rows:
+		raise ChainError("the chain is empty")
+	filters = []
+	for i, row in enumerate(rows):
+		if row[0] >= len(FILTER_NAMES):
+			raise ChainError("filter %d has no type %d" % (i, row[0]))
+		filters.append(Filter(i, row))
+	ids = [f.id for f in filters]
+	if len(set(ids)) != len(ids):
+		raise ChainError("filter ids must be unique")
+	# an id nobody has, like the head's, means no next filter
+	def lookup(uid):
+		return ids.index(uid) if uid in ids else 0
+
+	refcount = [0] * len(filters)
+	for row in rows:
+		f = filters[lookup(row[1])]
+		for link, errors in ((2, (1, 2)), (3, (3, 4))):
+			target = lookup(row[link])
+			if not target:
+				continue
+			if refcount[target] > filters[target].multi_input + 1:
+				raise ChainError("error %d: a third filter writes to filter id %d" % (errors[0], filters[target].id))
+			if target == f.index:
+				raise ChainError("error %d: filter id %d writes to itself" % (errors[1], f.id))
+			f.links.append((filters[target], refcount[target]))
+			if link == 2:
+				f.next = filters[target]
+			refcount[target] += 1
+
+	queue = [filters[0]] + [f for f in filters[1:] if refcount[f.index] == 0 and f.type in (INPUT, CHANNEL)]
+	for f in queue:
+		for target, buf_n in f.links:
+			if buf_n == 0:
+				queue.append(target)
+	controls = 0
+	for position, f in enumerate(queue):
+		f.position = position
+		if f.type in (REVERB, TREMOLO, FLANGE):
+			f.control = controls % CONTROL_RATE
+			controls += 1
+	return filters, queue
+
+class Buffer:
+	def __init__(self, prefix, owner, buf_n):
+		self.prefix, self.owner, self.buf_n = prefix, owner, buf_n
+		self.oldest = 0
+		self.writer = None
+		self.readers = []
+
+	def name(self):
+		return "%s_buf%d_%d" % (self.prefix, self.owner.id, self.buf_n)
+
+	def head(self):
+		return "%s_head%d_%d" % (self.prefix, self.owner.id, self.buf_n)
+
+	def size(self):
+		size = 1
+		while size <= self.oldest:
+			size <<= 1
+		return size
+
+	def ring(self):
+		return self.oldest > 0
+
+	# A single sample which is read after it is written is simply the writer's value.
+	def direct(self):
+		return not self.ring() and all(r.position > self.writer.position for r in self.readers)
+
+class Compiler:
+	def __init__(self, rows, function, source):
+		self.rows = rows
+		self.function = function
+		self.source = source
+		self.filters, self.order = build(rows)
+		self.buffers = {}
+		for f in self.order:
+			for owner, buf_n, oldest in f.reads():
+				b = self.buffers.setdefault((owner.index, buf_n), Buffer(function, owner, buf_n))
+				b.oldest = max(b.oldest, oldest)
+				b.readers.append(f)
+		for f in self.order:
+			for target, buf_n in f.links:
+				if (target.index, buf_n) in self.buffers:
+					self.buffers[(target.index, buf_n)].writer = f
+		# buffers nothing running writes to read silence, as unwritten ones do
+		for key in [k for k, b in self.buffers.items() if b.writer is None]:
+			del self.buffers[key]
+
+	def read(self, owner, buf_n, position):
+		b = self.buffers.get((owner.index, buf_n))
+		if b is None:
+			return "0"
+		if not b.ring():
+			return "v%d" % b.writer.id if b.direct() else b.name()
+		mask = b.size() - 1
+		if isinstance(position, int):
+			return "%s[(%s + %d) & %d]" % (b.name(), b.head(), ~position & mask, mask)
+		return "%s[(%s + ~(%s)) & %d]" % (b.name(), b.head(), position, mask)
+
+	# LFO at sample t. All but the sine count their period in samples.
+	def lfo(self, kind, freq, phase, t="t"):
+		if kind in (1, 2, 3, 4) and freq == 0:
+			return "0" # a zero period holds the LFO still
+		if kind == 1:
+			return "abs((int32_t)(%s %% %d) - %d) / %s" % (t, freq * 2, freq, float_literal(freq))
+		if kind == 2:
+			return "(%s %% %d) < %d ? 0 : 1" % (t, freq, freq // 2)
+		if kind == 3:
+			return "(%s %% %d) / %s" % (t, freq, float_literal(freq))
+		if kind == 4:
+			return "(%d - (%s %% %d)) / %s" % (freq, t, freq, float_literal(freq))
+		return "(sin(%s * ((float)%s / (float)frequency) + %d) + 1) * 0.5" % (double_literal(TWO_PI * freq), t, phase)
+
+	# LFO of a tremolo or flange: (type, frequency, phase).
+	def lfo_params(self, f):
+		p = f.params
+		if f.type == TREMOLO:
+			return p[3], p[1], scaled_phase(p[2])
+		return p[3], p[0], scaled_phase(p[1])
+
+	def control_name(self, f):
+		return "%s_control%d" % (self.function, f.id)
+
+	# Whether a filter's control steps at control rate. As filter_bind() has it, only
+	# sines do, the other LFOs would change shape and are worked out every sample.
+	def stepped(self, f):
+		return f.control is not None and (f.type == REVERB or self.lfo_params(f)[0] not in (1, 2, 3, 4))
+
+	# Control of a filter at sample t, see filter_control_functions.
+	def control(self, f):
+		if f.type in (TREMOLO, FLANGE):
+			return self.lfo(*self.lfo_params(f))
+		return "((sin(%s * ((float)t / (float)frequency)) + 1) * 0.25) + 0.5" % double_literal(TWO_PI * f.params[2])
+
+	# The body of a filter's kernel, leaving its output in v<id>.
+	def kernel(self, f):
+		p = f.params
+		v = "v%d" % f.id
+		x = lambda position: self.read(f, 0, position)
+		c = self.control_name(f)
+		if self.stepped(f):
+			control = ["float x = %s;" % c, "%s += %s_step;" % (c, c)]
+		elif f.type in (TREMOLO, FLANGE):
+			control = ["float x = %s;" % self.lfo(*self.lfo_params(f), t="cycle")]
+
+		if f.type == INPUT:
+			return ["%s = adc_get_data();" % v]
+		if f.type == CHANNEL:
+			return ["%s = adc_frame[%d];" % (v, min(p[0], ADC_CHANNELS - 1))]
+		if f.type == OUTPUT:
+			return ["dac_set_value(%s);" % x(0)]
+		if f.type == PASSTHROUGH:
+			return ["%s = %s;" % (v, x(0))]
+		if f.type == ZERO:
+			return ["%s = %d;" % (v, VALUE_ZERO)]
+		if f.type in (MAX, MIN):
+			limit = u16(p[0] * ADC_STEP_NUMERATOR // NUMBER_OF_STEPS)
+			return ["%s = %s;" % (v, x(0)),
+				"if (%s %s %d)" % (v, ">" if f.type == MAX else "<", limit),
+				"\t%s = %d;" % (v, limit)]
+		if f.type == SINE:
+			return ["float x = sin(%s * (((float)cycle) / frequency) + %d);" % (double_literal(TWO_PI * u16(p[1] * 100)), scaled_phase(p[2])),
+				"%s = (%d * x) + %d;" % (v, scaled_amplitude(p[0]), VALUE_ZERO)]
+		if f.type == TREMOLO:
+			depth = min(p[0], 100)
+			return ["int16_t v = %s;" % x(0)] + control + [
+				"v -= %d;" % VALUE_ZERO,
+				"v = (v * (x * %s));" % float_literal(f32(depth / 100.0)),
+				"v += %d;" % VALUE_ZERO,
+				"%s = v;" % v]
+		if f.type == REVERB:
+			return ["uint16_t delay = %d;" % f.delay()] + control + [
+				"delay = delay * x;",
+				"int16_t delay_v = (int16_t)%s;" % x("delay"),
+				"delay_v -= %d;" % VALUE_ZERO,
+				"delay_v *= %d;" % min(p[1], 100),
+				"delay_v /= 100;",
+				"%s = %s + delay_v;" % (v, x(1))]
+		if f.type == DELAY:
+			return ["%s = %s;" % (v, x(f.delay()))]
+		if f.type == MIX:
+			x1 = self.read(f, 1, 0)
+			if p[0] == NUMBER_OF_STEPS:
+				return ["%s = %s;" % (v, x(0))]
+			if p[0] == 0:
+				return ["%s = %s;" % (v, x1)]
+			return ["%s = (%d * %s) / %d + (%d * %s) / %d;" % (v, p[0], x(0), NUMBER_OF_STEPS, NUMBER_OF_STEPS - p[0], x1, NUMBER_OF_STEPS)]
+		if f.type == FLANGE:
+			return control + [
+				"uint16_t delay = x * %d;" % f.flange_delay(),
+				"%s = (%s + %s) / 2;" % (v, x(0), x("delay"))]
+		if f.type in (UPWARD_COMPRESSOR, DOWNWARD_COMPRESSOR):
+			upward = f.type == UPWARD_COMPRESSOR
+			threshold = u16(VALUE_ZERO + scaled_amplitude(p[0]) if upward else VALUE_ZERO - scaled_amplitude(p[0]))
+			ratio = p[1] or 1
+			lines = ["%s = %s;" % (v, x(0))]
+			if ratio > 1:
+				lines += ["if (%s %s %d)" % (v, ">" if upward else "<", threshold),
+					("\t%s = %d + (uint16_t)(%s - %d) / %d;" if upward else "\t%s = %d - (uint16_t)(%d - %s) / %d;") %
+						((v, threshold, v, threshold, ratio) if upward else (v, threshold, threshold, v, ratio))]
+			return lines
+		if f.type == N_BITS:
+			shift = 12 - min(p[0], 12)
+			if shift == 0:
+				return ["%s = %s;" % (v, x(0))]
+			return ["%s = %s & 0x%X;" % (v, x(0), 0xFFFF & ~((1 << shift) - 1))]
+		if f.type == DISTORTION:
+			distortion = scaled_amplitude(p[0])
+			return ["%s = %s;" % (v, x(0)),
+				"if (%s > %d)" % (v, VALUE_ZERO + distortion),
+				"\t%s = %d;" % (v, VALUE_ZERO + distortion),
+				"if (%s < %d)" % (v, VALUE_ZERO - distortion),
+				"\t%s = %d;" % (v, VALUE_ZERO - distortion)]
+		if f.type == TRIANGLE:
+			freq = p[0]
+			if freq == 0:
+				return ["%s = %d; // a zero period gives silence" % (v, VALUE_ZERO)]
+			return ["float x = 2 * (abs((cycle %% %d) - %d) / %s) - 1;" % (freq * 2, freq, float_literal(freq)),
+				"%s = %d + (x * %d);" % (v, VALUE_ZERO, scaled_amplitude(p[1]))]
+		if f.type == NOISE_CANCELLATION:
+			samples = p[1]
+			lines = ["uint16_t v = %s;" % x(0)]
+			if samples == 0:
+				lines += ["uint16_t avg = 0; // nothing to average"]
+			else:
+				lines += ["uint16_t avg = 0;",
+					"uint16_t i;",
+					"for (i = 1; i < %d; i++) {" % (samples + 1),
+					"\tavg += %s;" % x("i"),
+					"}",
+					"avg /= %d;" % samples]
+			return lines + ["uint16_t diff = abs(avg - v);",
+				"if (diff > %d)" % u16(p[0] * 5),
+				"\tv = avg;",
+				"%s = v;" % v]
+		# high, low and all-pass
+		offset = " - %d" % VALUE_ZERO if f.type == AEC_LOWPASS else ""
+		y = lambda position: self.read(f.next, 0, position) if f.next else "0"
+		samples = [x(0), x(1), x(2), y(1), y(2)]
+		terms = [(c, s, "+" if i < 3 else "-") for i, (c, s) in enumerate(zip(aec_coefficients(f.type)[1], samples)) if c != 0]
+		lines = ["float vf = 0;"]
+		for c, s, sign in terms:
+			lines.append("vf %s= %s * (float)(%s%s);" % (sign, float_literal(c), s, offset))
+		return lines + ["%s = vf%s;" % (v, " + %d" % VALUE_ZERO if offset else "")]
+
+	def emit(self, out):
+		w = lambda line="": out.write(line + "\n")
+		rings = [b for b in self.buffers.values() if b.ring()]
+		carried = [b for b in self.buffers.values() if not b.ring() and not b.direct()]
+		controlled = [f for f in self.order if self.stepped(f)]
+		key = lambda b: (b.owner.id, b.buf_n)
+
+		w("// Generated by chain2c.py from %s, do not edit." % self.source)
+		w("// %d filters, %d of which run, compiled to straight-line code (see README.md)." % (len(self.filters), len(self.order)))
+		w()
+		w(HOST_PRELUDE)
+		w("#define COMPILED_CHAIN_FILTERS %d" % len(self.rows))
+		w()
+		w("// The chain compiled, laid out as in filters_buf.")
+		w("uint16_t compiled_chain_spec[COMPILED_CHAIN_FILTERS*8] = {")
+		for row in self.rows:
+			w("\t" + ", ".join(str(v) for v in row) + ",")
+		w("};")
+		if rings:
+			w()
+			w("// Samples the filters read back in time, each as long as the oldest read.")
+			for b in sorted(rings, key=key):
+				w("uint16_t %s[%d];" % (b.name(), b.size()))
+				w("uint16_t %s;" % b.head())
+		if carried:
+			w()
+			w("// Samples read by filters which run before the one writing them, a sample late.")
+			for b in sorted(carried, key=key):
+				w("uint16_t %s;" % b.name())
+		if controlled:
+			w()
+			w("// LFOs, which step at control rate (see filter_control_step).")
+			for f in controlled:
+				w("float %s, %s_step;" % (self.control_name(f), self.control_name(f)))
+			w("uint16_t %s_slot;" % self.function)
+		w()
+		w("// Start the chain from silence with its LFOs where they are now, as building it does.")
+		w("void %s_start(void)" % self.function)
+		w("{")
+		if controlled:
+			w("\tuint32_t t = cycle;")
+			w()
+		for b in sorted(rings, key=key):
+			w("\tmemset(%s, 0, sizeof(%s));" % (b.name(), b.name()))
+			w("\t%s = 0;" % b.head())
+		for b in sorted(carried, key=key):
+			w("\t%s = 0;" % b.name())
+		for f in controlled:
+			w("\t%s = %s;" % (self.control_name(f), self.control(f)))
+			w("\t%s_step = 0;" % self.control_name(f))
+		if controlled:
+			w("\t%s_slot = 0;" % self.function)
+		w("}")
+		w()
+		w("// Run the chain for one sample.")
+		w("void %s(void)" % self.function)
+		w("{")
+		outputs = [f for f in self.order if f.type != OUTPUT]
+		if outputs:
+			w("\tuint16_t %s;" % ", ".join("v%d" % f.id for f in outputs))
+			w()
+		if controlled:
+			w("\t// the LFOs of this sample's slot work out where they will be a control period on")
+			w("\t%s_slot = (%s_slot + 1) & %d;" % (self.function, self.function, CONTROL_RATE - 1))
+			for slot in sorted(set(f.control for f in controlled)):
+				w("\tif (%s_slot == %d) {" % (self.function, slot))
+				w("\t\tuint32_t t = (uint32_t)cycle + %d;" % CONTROL_RATE)
+				for f in controlled:
+					if f.control == slot:
+						c = self.control_name(f)
+						w("\t\t%s_step = ((float)(%s) - %s) * (1.0f / %d);" % (c, self.control(f), c, CONTROL_RATE))
+				w("\t}")
+			w()
+		for f in self.order:
+			w("\t// %s" % f.name())
+			lines = self.kernel(f)
+			scoped = any(re.match(r"(u?int\w+|float) ", line) for line in lines)
+			if scoped:
+				w("\t{")
+			for line in lines:
+				w("\t" + ("\t" if scoped else "") + line)
+			if scoped:
+				w("\t}")
+			for target, buf_n in f.links:
+				b = self.buffers.get((target.index, buf_n))
+				if b is None or b.direct():
+					continue
+				if b.ring():
+					w("\t%s[%s++ & %d] = v%d;" % (b.name(), b.head(), b.size() - 1, f.id))
+				else:
+					w("\t%s = v%d;" % (b.name(), f.id))
+		w("}")
+
+def main(argv):
+	usage = "usage: chain2c.py [--name function] (chain.txt | --flash dump.bin --slot n)"
+	function = "compiled_chain"
+	flash = slot = path = None
+	args = list(argv[1:])
+	try:
+		while args:
+			arg = args.pop(0)
+			if arg == "--name":
+				function = args.pop(0)
+			elif arg == "--flash":
+				flash = args.pop(0)
+			elif arg == "--slot":
+				slot = int(args.pop(0))
+			elif path is None and not arg.startswith("--"):
+				path = arg
+			else:
+				raise IndexError
+	except (IndexError, ValueError):
+		print(usage, file=sys.stderr)
+		return 2
+	if (flash is None) == (path is None) or (flash is not None and slot is None):
+		print(usage, file=sys.stderr)
+		return 2
+
+	try:
+		if flash is not None:
+			rows, source = read_flash_preset(flash, slot), "slot %d of %s" % (slot, flash)
+		else:
+			rows, source = read_chain_file(path), path
+		Compiler(rows, function, source).emit(sys.stdout)
+	except (ChainError, IOError) as e:
+		print("chain2c.py: %s" % e, file=sys.stderr)
+		return 1
+	return 0
+
+if __name__ == "__main__":
+	sys.exit(main(sys.argv))
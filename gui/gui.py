@@ -3,17 +3,46 @@
 # Author: Zisu Andrei
 # It uses the pyGTK library, and pySerial library. It uses a GTK Glade XML file to describe the layout
 
-from gi.repository import Gtk
+from gi.repository import Gtk, GLib
 import serial
 import os.path
 import io
+import binascii
+
+CORE_CLOCK = 100000000 # cycles per second of the board's Cortex-M3
+VALUE_RANGE = 3300 # largest sample value, see firmware/filter_chain.c
+NUMBER_OF_STEPS = 100 # largest parameter value
+
+# Capture of a filter's output, see firmware/capture.h
+CAPTURE_LENGTH = 1024
+CAPTURE_LINE_SAMPLES = 8
+CAPTURE_STOP = 3 # any trigger past the last one stops capturing
+CAPTURE_STATES = ["off", "armed", "triggered", "done"]
+SCOPE_POLL_INTERVAL = 100 # milliseconds between requests for captured samples
+SCOPE_POLL_REQUESTS = 16 # most requests per poll in the plain protocol, which sends a few samples each
+
+# Binary protocol, see firmware/serial.h
+PROTOCOL_VERSION = 1
+PLAIN_BAUDRATE = 9600
+BINARY_BAUDRATE = 115200
+FRAME_SYNC = 0xA5
+FRAME_STATUS_OK = 0
+FRAME_STATUS_INIT = 4
+FRAME_STATUS_MORE = 0x80
 
 # Serial communication API
 class Api:
 	connector = None
 	running = False
+	binary = False # using the binary protocol?
+	seq = 0 # sequence number of the last binary request
+	pending = [] # lines of the last binary reply not handed out by sendMessage yet
+	pendingCommand = None
 
 	def sendMessage(self, message):
+		if self.binary:
+			return self.sendBinaryMessage(message)
+
 		#@improvement: print debug messages 
 		print("Sending "+ repr(message.ljust(16,'0')))
 
@@ -28,7 +57,82 @@ class Api:
 
 
 		return recieved
-		
+
+	# Send a binary frame with a command and its payload
+	def sendFrame(self, command, payload):
+		self.seq = (self.seq + 1) & 0xFF
+		body = command + chr(self.seq) + chr(0) + chr(len(payload) & 0xFF) + chr(len(payload) >> 8) + payload
+		crc = binascii.crc_hqx(body, 0xFFFF)
+
+		print("Sending frame "+ repr(body))
+
+		self.connector.write(chr(FRAME_SYNC) + body + chr(crc & 0xFF) + chr(crc >> 8))
+		self.connector.flush()
+
+	# Read a binary frame: (command, sequence number, status, payload), None if it is missing or corrupted
+	def readFrame(self):
+		while True:
+			sync = self.connector.read(1)
+			if sync == "":
+				return None
+			if ord(sync) == FRAME_SYNC:
+				break
+
+		header = self.connector.read(5)
+		if len(header) != 5:
+			return None
+		length = ord(header[3]) | (ord(header[4]) << 8)
+
+		rest = self.connector.read(length + 2)
+		if len(rest) != length + 2:
+			return None
+		payload = rest[:length]
+		crc = ord(rest[length]) | (ord(rest[length + 1]) << 8)
+		if binascii.crc_hqx(header + payload, 0xFFFF) != crc:
+			return None
+
+		print("Recieved frame "+ repr(header + payload))
+
+		return (header[0], ord(header[1]), ord(header[2]), payload)
+
+	# Send a binary request and collect its replies: (final status, lines of text, final payload)
+	def request(self, command, payload = ""):
+		self.sendFrame(command, payload)
+
+		lines = []
+		while True:
+			frame = self.readFrame()
+			if frame == None or frame[1] != self.seq:
+				return (None, lines, "")
+			if frame[2] & FRAME_STATUS_MORE:
+				lines.append(frame[3])
+			else:
+				return (frame[2], lines, frame[3])
+
+	# Behave like sendMessage over the binary protocol: the firmware sends every line
+	# of a multi-line reply at once, so repeating the command just hands out the next
+	def sendBinaryMessage(self, message):
+		if self.pending and message == self.pendingCommand:
+			return self.pending.pop(0)
+
+		(status, lines, payload) = self.request(message[0], message[1:])
+		if not lines:
+			self.pending = []
+			return payload
+		self.pending = lines[1:]
+		self.pendingCommand = message[0]
+		return lines[0]
+
+	# Switch to the binary protocol at a higher baud rate if the firmware supports it
+	def negotiate(self):
+		if self.sendMessage("v"+chr(PROTOCOL_VERSION)+str(BINARY_BAUDRATE)+chr(0)) == "Version:"+str(PROTOCOL_VERSION):
+			self.connector.baudrate = BINARY_BAUDRATE
+			self.connector.timeout = 1
+			self.binary = True
+			print("Using binary protocol")
+		else:
+			print("Using plain protocol")
+
 	def connect(self):
 		if self.connector == None: 
 			self.connector = serial.Serial(port='/dev/ttyACM0', baudrate=9600, timeout=0.1)
@@ -39,6 +143,7 @@ class Api:
 
 		if self.connector.isOpen() and self.sendMessage("0") == "Noop": #send noop command
 			print("Connected")
+			self.negotiate()
 			return True
 		else:
 			print("Error")
@@ -60,6 +165,13 @@ class Api:
 		if not self.isConnected(): 
 			return False
 
+		# leave the firmware in the plain protocol for the next connection
+		if self.binary:
+			self.sendMessage("v"+chr(0)+str(PLAIN_BAUDRATE)+chr(0))
+			self.binary = False
+			self.connector.baudrate = PLAIN_BAUDRATE
+			self.connector.timeout = 0.1
+
 		self.connector.close()
 
 		if self.connector.isOpen():
@@ -75,36 +187,64 @@ class Api:
 		if not self.isConnected():
 			return False
 
+		if self.binary:
+			return self.setFiltersBinary(filters)
+
 		if self.sendMessage("a"+chr(len(filters))) != "Apply":
 			print("Error")
 			return False
 
 		for filter in filters:
-			paramsBuf = ""
-
-			# generate the string of chars simbolizing the parameters 
-			if filter[1] != "":
-				split = filter[1].split(",")[0:4] # only use the first 4
-				for element in split:
-					paramsBuf += chr(int(element))
-
-			outputBuf = ""
-
-			# generate the string of chars simbolizing the outputs 
-			if filter[2] != "":
-				split = filter[2].split(",")[0:2] # only use the first 2
-				for element in split:
-					outputBuf += chr(int(element))
-				outputBuf = outputBuf.ljust(2, "0")
-
-			if self.sendMessage("f"+chr(filter[0])+chr(filter[3])+outputBuf+paramsBuf) != "Filter":
+			if self.sendMessage("f"+self.filterBytes(filter)) != "Filter":
 				print("Error")
 				return False
 
-		if self.sendMessage("a") == "End filters":
+		value = self.sendMessage("a")
+		if value == "End filters":
+			print("Filters set")
+			self.running = True
+			return True
+		elif "Max:" in value:
+			# the chain is too slow for the current frequency
+			print("Filter chain too slow, highest usable frequency is "+value.split("Max:")[1])
+			return False
+		else:
+			print("Error")
+			return False
+
+	# The 8 bytes of a filter, the same for the "f" command and the binary apply:
+	# type, unique id, 2 outputs and 4 parameters, those left out sent as 0 (no
+	# output), not padded with "0" like the rest of a plain command
+	def filterBytes(self, filter):
+		params = []
+		if filter[1] != "":
+			params = [int(x) for x in filter[1].split(",")[0:4]] # only use the first 4
+		outputs = []
+		if filter[2] != "":
+			outputs = [int(x) for x in filter[2].split(",")[0:2]] # only use the first 2
+
+		values = [filter[0], filter[3]] + (outputs + [0, 0])[0:2] + (params + [0, 0, 0, 0])[0:4]
+		return "".join([chr(x) for x in values])
+
+	# Send the whole chain in one frame, 8 bytes per filter as for the "f" command
+	def setFiltersBinary(self, filters):
+		chain = ""
+		for filter in filters:
+			chain += self.filterBytes(filter)
+
+		(status, lines, payload) = self.request("a", chain)
+		if status == FRAME_STATUS_OK:
 			print("Filters set")
 			self.running = True
 			return True
+		elif status == FRAME_STATUS_INIT:
+			maxFrequency = ord(payload[1]) | (ord(payload[2]) << 8) | (ord(payload[3]) << 16) | (ord(payload[4]) << 24)
+			if ord(payload[0]) == 5:
+				# the chain is too slow for the current frequency
+				print("Filter chain too slow, highest usable frequency is "+str(maxFrequency))
+			else:
+				print("Error: "+str(ord(payload[0])))
+			return False
 		else:
 			print("Error")
 			return False
@@ -117,9 +257,14 @@ class Api:
 			print("Error")
 			return False
 
-		if self.sendMessage("s"+str(frequency)+chr(0)) == "Set":
+		value = self.sendMessage("s"+str(frequency)+chr(0))
+		if value == "Set":
 			print("Frequency set")
 			return True
+		elif "Max:" in value:
+			# the running chain can't keep up with this frequency
+			print("Frequency too high for the filter chain, highest usable is "+value.split("Max:")[1])
+			return False
 		else:
 			print("Error")
 			return False
@@ -141,6 +286,14 @@ class Api:
 		if not self.isConnected():
 			return False
 
+		if self.binary:
+			# the whole chain comes in one frame, 8 bytes per filter
+			(status, lines, payload) = self.request("d")
+			if status != FRAME_STATUS_OK:
+				print("Error")
+				return False
+			return [[ord(x) for x in payload[i:i+8]] for i in range(0, len(payload), 8)]
+
 		value = self.sendMessage("d")
 
 		if value.startswith("Download:"):
@@ -164,6 +317,160 @@ class Api:
 			print("Error")
 			return False
 
+	def profile(self):
+		if not self.isConnected():
+			return False
+
+		value = self.sendMessage("p")
+
+		if value.startswith("Profile:"):
+			# first line is the whole interrupt: count, last, max, mean and
+			# the time from reset to the first sample in us
+			fields = [int(x) for x in value[8:].split(",")] #skip the "profile:" prefix
+			count = fields[0]
+			isr = fields[1:5]
+			print("Profile interrupt "+str(isr))
+
+			filters = []
+			for i in range(count):
+				value = self.sendMessage("p")
+				if not value.startswith("Profile:"):
+					print("Error")
+					return False
+
+				# filter id, last, max, mean
+				filters.append([int(x) for x in value[8:].split(",")]) #skip the "profile:" prefix
+
+			return (isr, filters)
+		else:
+			print("Error")
+			return False
+
+	def xruns(self):
+		if not self.isConnected():
+			return False
+
+		value = self.sendMessage("o")
+
+		if value.startswith("Xrun:"):
+			# overruns, missed samples, worst lateness in us, bypassed
+			return [int(x) for x in value[5:].split(",")] #skip the "xrun:" prefix
+		else:
+			print("Error")
+			return False
+
+	def setBypassLimit(self, limit):
+		if not self.isConnected():
+			return False
+
+		if limit < 0 or limit > 255:
+			print("Error")
+			return False
+
+		if self.sendMessage("b"+chr(limit)) == "Bypass":
+			print("Bypass limit set")
+			return True
+		else:
+			print("Error")
+			return False
+
+	# Change one parameter of the running chain, the firmware ramps gains and
+	# depths to the new value instead of rebuilding the chain
+	def updateParameter(self, filterId, index, value):
+		if not self.isConnected():
+			return False
+
+		if value < 0 or value > 254:
+			print("Error")
+			return False
+
+		if self.sendMessage("u"+chr(filterId)+chr(index)+chr(value)) == "Update":
+			return True
+		else:
+			print("Error")
+			return False
+
+	# Tap the output of a filter: trigger 0 rising, 1 falling, 2 free running,
+	# level in parameter steps, pre-trigger depth in percent, keep one sample in decimation
+	def capture(self, filterId, trigger, level, pretrigger, decimation):
+		if not self.isConnected():
+			return False
+
+		if self.sendMessage("c"+chr(filterId)+chr(trigger)+chr(level)+chr(pretrigger)+chr(decimation)) == "Capture":
+			return True
+		else:
+			print("Error")
+			return False
+
+	def stopCapture(self):
+		return self.capture(0, CAPTURE_STOP, 0, 0, 0)
+
+	# Collect captured samples which are ready: (state, overruns, samples)
+	def scope(self):
+		if not self.isConnected():
+			return False
+
+		if self.binary:
+			# the samples come as the payload of the final frame rather than text
+			(status, lines, payload) = self.request("r")
+			if status != FRAME_STATUS_OK or len(payload) < 3:
+				print("Error")
+				return False
+			samples = [ord(payload[i]) | (ord(payload[i+1]) << 8) for i in range(3, len(payload) - 1, 2)]
+			return (ord(payload[0]), ord(payload[1]) | (ord(payload[2]) << 8), samples)
+
+		value = self.sendMessage("r")
+
+		if value.startswith("Scope:"):
+			# state, overruns, samples
+			fields = [int(x) for x in value[6:].split(",")] #skip the "scope:" prefix
+			return (fields[0], fields[1], fields[2:])
+		else:
+			print("Error")
+			return False
+
+	def memory(self):
+		if not self.isConnected():
+			return False
+
+		value = self.sendMessage("m")
+
+		if value.startswith("Memory:"):
+			# filters, most filters, queue elements, most queue elements, allocator errors
+			structs = [int(x) for x in value[7:].split(",")] #skip the "memory:" prefix
+
+			# each sample pool: used, free, largest free, most used, fragmentation and its map
+			pools = []
+			for i in range(2):
+				value = self.sendMessage("m")
+				if not value.startswith("Pool:"):
+					print("Error")
+					return False
+				pool = [int(x) for x in value[5:].split(",")] #skip the "pool:" prefix
+
+				value = self.sendMessage("m")
+				if not value.startswith("Map:"):
+					print("Error")
+					return False
+				pool.append(value[4:])
+
+				pools.append(pool)
+
+			filters = []
+			for i in range(structs[0]):
+				value = self.sendMessage("m")
+				if not value.startswith("Filter:"):
+					print("Error")
+					return False
+
+				# filter id, words of memory, samples held
+				filters.append([int(x) for x in value[7:].split(",")]) #skip the "filter:" prefix
+
+			return (structs, pools, filters)
+		else:
+			print("Error")
+			return False
+
 	def isConnected(self): 
 		if self.connector != None and self.connector.isOpen():
 			return True
@@ -205,6 +512,9 @@ class Handler:
 	chosenMaxId = 2
 	chosenModel = None
 	availableModel = None
+	scopeSamples = [] # samples shown by the scope
+	scopeLevel = 0 # trigger level of the scope, as a sample value
+	scopePolling = False
 
 	def __init__(self, builder, api): 
 		self.api = api
@@ -234,6 +544,9 @@ class Handler:
 			button.set_sensitive(False)
 			self.builder.get_object("buttondisconnect").set_sensitive(True)
 			self.builder.get_object("buttonsetfrequency").set_sensitive(True)
+			self.builder.get_object("buttonprofile").set_sensitive(True)
+			self.builder.get_object("buttonmemory").set_sensitive(True)
+			self.builder.get_object("buttonscope").set_sensitive(True)
 			self.builder.get_object("buttonapplybegin").set_sensitive(True)
 			self.builder.get_object("buttonstop").set_sensitive(True)
 			self.builder.get_object("buttondownload").set_sensitive(True)
@@ -245,6 +558,9 @@ class Handler:
 			self.builder.get_object("buttonconnect").set_sensitive(True)
 			button.set_sensitive(False)
 			self.builder.get_object("buttonsetfrequency").set_sensitive(False)
+			self.builder.get_object("buttonprofile").set_sensitive(False)
+			self.builder.get_object("buttonmemory").set_sensitive(False)
+			self.builder.get_object("buttonscope").set_sensitive(False)
 			self.builder.get_object("buttonapplybegin").set_sensitive(False)
 			self.builder.get_object("buttonstop").set_sensitive(False)
 			self.builder.get_object("buttondownload").set_sensitive(False)
@@ -276,8 +592,16 @@ class Handler:
 		self.chosenIter = treeiter
 
 	def propertiesEdited(self, widget, path, new_text):
+		old = self.chosenModel[path][2].split(",")[0:4]
 		self.chosenModel[path][2] = new_text
 
+		# send changed parameters straight to the running chain
+		if self.api.isRunning():
+			new = new_text.split(",")[0:4]
+			for index in range(len(new)):
+				if index >= len(old) or old[index] != new[index]:
+					self.api.updateParameter(self.chosenModel[path][4], index, int(new[index]))
+
 
 	def outputEdited(self, widget, path, new_text):
 		self.chosenModel[path][3] = str(new_text)
@@ -335,6 +659,190 @@ class Handler:
 				True
 			])
 
+	def refreshProfile(self, *args):
+		profile = self.api.profile()
+		if profile == False:
+			return
+
+		(isr, profiledFilters) = profile
+
+		# the cycle budget for one sample is the core clock over the sample rate
+		frequency = self.api.getFrequency()
+		label = "Interrupt: last "+str(isr[0])+", max "+str(isr[1])+", mean "+str(isr[2])+" cycles"
+		if frequency:
+			budget = CORE_CLOCK / frequency
+			label += " ("+str(isr[1] * 100 / budget)+"% of "+str(budget)+" at worst)"
+		if len(isr) > 3 and isr[3]:
+			label += "\nReset to first sample: "+str(isr[3])+"us"
+
+		xruns = self.api.xruns()
+		if xruns != False:
+			label += "\nOverruns: "+str(xruns[0])+", missed samples "+str(xruns[1])+", worst lateness "+str(xruns[2])+"us"
+			if xruns[3]:
+				label += ", bypassed"
+		self.builder.get_object("profilelabel").set_text(label)
+
+		# look up names of the chosen filters by unique id
+		names = {}
+		for filter in self.chosenModel:
+			names[filter[4]] = filter[0]
+
+		profileModel = self.builder.get_object("profilestore")
+		profileModel.clear()
+		for filter in profiledFilters:
+			#id, name, last, max, mean
+			profileModel.append([filter[0], names.get(filter[0], ""), filter[1], filter[2], filter[3]])
+
+	def openProfileWindow(self, *args):
+		self.refreshProfile()
+		self.builder.get_object("profileBox").set_visible(True)
+
+	def deleteProfileWindow(self, *args):
+		self.builder.get_object("profileBox").set_visible(False)
+
+		# this inhibits the propagation of the delete event,
+		# thus not deleting the elements inside the window
+		# which, otherwise, seems to be the default behaviour of GTK3
+		return True
+
+	# Set how many overrun blocks in a row make the firmware fall back to bypass
+	def setBypassLimitClicked(self, *args):
+		limit = self.builder.get_object("profilebypassinput").get_text().strip()
+		if not limit.isdigit() or not self.api.setBypassLimit(int(limit)):
+			self.builder.get_object("profilelabel").set_text("The bypass limit must be 0-255, 0 never bypasses")
+			return
+
+		self.refreshProfile()
+
+	def refreshMemory(self, *args):
+		memory = self.api.memory()
+		if memory == False:
+			return
+
+		(structs, pools, filters) = memory
+
+		label = "Filters: "+str(structs[0])+" (most "+str(structs[1])+"), queue elements: "+str(structs[2])+" (most "+str(structs[3])+")"
+		if structs[4]:
+			label += ", allocator errors: "+str(structs[4])
+		names = ["Main SRAM", "AHB SRAM"]
+		for i in range(len(pools)):
+			(used, free, largest, most, fragmentation, map) = pools[i]
+			label += "\n"+names[i]+": "+str(used)+" samples used, "+str(free)+" free, largest free "+str(largest)
+			label += ", most used "+str(most)+", "+str(fragmentation)+"% fragmented"
+			label += "\n<tt>"+map+"</tt>"
+		self.builder.get_object("memorylabel").set_markup(label)
+
+		# look up names of the chosen filters by unique id
+		names = {}
+		for filter in self.chosenModel:
+			names[filter[4]] = filter[0]
+
+		memoryModel = self.builder.get_object("memorystore")
+		memoryModel.clear()
+		for filter in filters:
+			#id, name, samples held, bytes
+			memoryModel.append([filter[0], names.get(filter[0], ""), filter[2], filter[1] * 2])
+
+	def openMemoryWindow(self, *args):
+		self.refreshMemory()
+		self.builder.get_object("memoryBox").set_visible(True)
+
+	def deleteMemoryWindow(self, *args):
+		self.builder.get_object("memoryBox").set_visible(False)
+
+		# this inhibits the propagation of the delete event,
+		# thus not deleting the elements inside the window
+		return True
+
+	def armScope(self, *args):
+		filterId = int(self.builder.get_object("scopefilterinput").get_text().strip())
+		trigger = self.builder.get_object("scopetriggerinput").get_active()
+		level = int(self.builder.get_object("scopelevelinput").get_text().strip())
+		pretrigger = int(self.builder.get_object("scopepretriggerinput").get_text().strip())
+		decimation = int(self.builder.get_object("scopedecimationinput").get_text().strip())
+
+		if not self.api.capture(filterId, trigger, level, pretrigger, decimation):
+			self.builder.get_object("scopelabel").set_text("No filter "+str(filterId)+" in the running chain, or no memory for the capture")
+			return
+
+		self.scopeSamples = []
+		self.scopeLevel = level * VALUE_RANGE / NUMBER_OF_STEPS
+		self.builder.get_object("scopearea").queue_draw()
+		if not self.scopePolling:
+			self.scopePolling = True
+			GLib.timeout_add(SCOPE_POLL_INTERVAL, self.pollScope)
+
+	def stopScope(self, *args):
+		self.scopePolling = False
+		self.api.stopCapture()
+
+	# Collect the samples captured since the last poll, called by a GLib timeout
+	# for as long as it returns True
+	def pollScope(self):
+		if not self.scopePolling:
+			return False
+
+		for i in range(SCOPE_POLL_REQUESTS):
+			scope = self.api.scope()
+			if scope == False:
+				self.scopePolling = False
+				return False
+
+			(state, overruns, samples) = scope
+			# free running captures scroll, keeping the most recent samples
+			self.scopeSamples = (self.scopeSamples + samples)[-CAPTURE_LENGTH:]
+			if len(samples) < CAPTURE_LINE_SAMPLES:
+				break
+
+		label = "Capture "+CAPTURE_STATES[state]+", "+str(len(self.scopeSamples))+" samples"
+		if overruns:
+			label += ", "+str(overruns)+" dropped"
+		self.builder.get_object("scopelabel").set_text(label)
+		self.builder.get_object("scopearea").queue_draw()
+
+		# a triggered capture is over once it is done and everything has been read
+		if state == CAPTURE_STATES.index("done") and len(samples) == 0:
+			self.scopePolling = False
+			return False
+		return True
+
+	def drawScope(self, widget, cr):
+		width = widget.get_allocated_width()
+		height = widget.get_allocated_height()
+
+		cr.set_source_rgb(0, 0, 0)
+		cr.paint()
+
+		# trigger level
+		cr.set_source_rgb(0.4, 0.4, 0.4)
+		y = height - self.scopeLevel * height / float(VALUE_RANGE)
+		cr.move_to(0, y)
+		cr.line_to(width, y)
+		cr.stroke()
+
+		cr.set_source_rgb(0, 1, 0)
+		for i in range(len(self.scopeSamples)):
+			x = i * width / float(CAPTURE_LENGTH - 1)
+			y = height - self.scopeSamples[i] * height / float(VALUE_RANGE)
+			if i == 0:
+				cr.move_to(x, y)
+			else:
+				cr.line_to(x, y)
+		cr.stroke()
+
+		return False
+
+	def openScopeWindow(self, *args):
+		self.builder.get_object("scopeBox").set_visible(True)
+
+	def deleteScopeWindow(self, *args):
+		self.stopScope()
+		self.builder.get_object("scopeBox").set_visible(False)
+
+		# this inhibits the propagation of the delete event,
+		# thus not deleting the elements inside the window
+		return True
+
 	def loadBlock(self, *args):
 		value = self.builder.get_object("blockloadinput").get_text().strip()
 
@@ -412,7 +920,8 @@ filters = [
 	"Noise Reduction",
 	"AEC Low Pass",
 	"AEC High Pass",
-	"AEC All Pass"
+	"AEC All Pass",
+	"Channel Input"
 ]
 
 availableModel = builder.get_object("availablefilterstore")